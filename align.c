@@ -0,0 +1,110 @@
+// Aligning the output with .align, .p2align and .balign.
+//
+// The padding is worked out from the pc when the directive is assembled,
+// and every alignment is recorded.  A chunk of a parallel assembly does
+// not know where it starts, and relaxation moves the output after a
+// branch that changes size, so relaxation lays the alignments out again
+// along with the branches.
+//
+// The padding is nops, with zeros before them if the pc is not where an
+// instruction can start, unless a fill byte is given.
+
+// The largest alignment is 1 << ALIGN_MAX_LOG2 bytes.
+#define ALIGN_MAX_LOG2 30
+
+// Returns the padding that the alignment needs if it starts at offset.
+static uint32_t
+align_padding(const Align *a, uint64_t offset)
+{
+    uint32_t n = -offset & (a->align - 1);
+    return n > a->max ? 0 : n;
+}
+
+// Whether some alignment does not have the padding that it needs where it
+// is, as one in a chunk of a parallel assembly can.
+static bool
+align_misplaced(const State *st)
+{
+    for (size_t i = 0; i < st->n_aligns; i++) {
+        const Align *a = &st->aligns[i];
+        if (align_padding(a, a->offset) != a->size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Records the alignment and emits its padding.
+static void
+emit_align(Output *out, State *st, Align a, Target target)
+{
+    st->aligns = grow(st->aligns, &st->cap_aligns, st->n_aligns + 1,
+            sizeof *st->aligns);
+    st->aligns[st->n_aligns++] = a;
+    st->pc += a.size;
+    if (a.fill >= 0) {
+        output_fill(out, a.fill, a.size);
+        return;
+    }
+    uint32_t step = target & TARGET_C ? 2 : 4;
+    uint32_t zeros = -a.offset & (step - 1);
+    if (zeros > a.size) {
+        zeros = a.size;
+    }
+    output_fill(out, 0, zeros);
+    uint32_t n = a.size - zeros;
+    for (; n >= 4; n -= 4) {
+        output32(out, PSEUDO_ADDI);  // nop
+    }
+    if (n) {
+        output16(out, 0x0001);  // c.nop
+    }
+}
+
+// .align and .p2align take the log2 of the alignment, and .balign the
+// alignment itself.  An optional fill byte and an optional most bytes to
+// skip can follow, the fill byte left out if only the second is given:
+//
+//     .p2align 6, , 16
+static void
+compile_align(Output *out, State *st, const Token *name, bool log2,
+        Target target)
+{
+    int64_t n = read_const_expr(st).result;
+    if (log2 ? n < 0 || n > ALIGN_MAX_LOG2
+            : n < 1 || n > (int64_t)1 << ALIGN_MAX_LOG2)
+    {
+        error(st, "Alignment out of range: %lld", (long long)n);
+        return;
+    }
+    if (!log2 && (n & (n - 1))) {
+        error(st, "Alignment not a power of 2: %lld", (long long)n);
+        return;
+    }
+    Align a = {
+        .offset = st->pc,
+        .pos = tok_pos(st, name),
+        .align = log2 ? (uint32_t)1 << n : (uint32_t)n,
+        .fill = -1,
+    };
+    a.max = a.align - 1;
+    if (is_punct(st, peek_token(st), ',')) {
+        read_token(st);
+        if (!is_punct(st, peek_token(st), ',')) {
+            a.fill = (uint8_t)read_const_expr(st).result;
+        }
+        if (is_punct(st, peek_token(st), ',')) {
+            read_token(st);
+            int64_t max = read_const_expr(st).result;
+            if (max < 0) {
+                error(st, "Maximum out of range: %lld", (long long)max);
+                return;
+            }
+            if (max < a.max) {
+                a.max = max;
+            }
+        }
+    }
+    a.size = align_padding(&a, st->pc);
+    emit_align(out, st, a, target);
+}
@@ -0,0 +1,249 @@
+// Assembling many independent files in one run, each into its own image.
+//
+// The files are handed out to the threads one at a time from a shared
+// cursor, so a thread that gets small files simply takes more of them.
+// Every thread keeps one library context for all its files.
+
+#include <time.h>
+
+struct Batch {
+    char **inputs;
+    size_t n_inputs;
+    const char *out_dir;
+    Target target;
+    atomic_size_t next;  // The next input to assemble.
+
+    atomic_size_t n_failed;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+};
+typedef struct Batch Batch;
+
+// Returns the name of the image of an input: its file name, without the
+// directory and the extension, with ".bin" added, in the output directory.
+static char *
+batch_output_name(const char *out_dir, const char *input)
+{
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    const char *dot = strrchr(base, '.');
+    size_t base_len = dot && dot != base ? (size_t)(dot - base) : strlen(base);
+    size_t len = strlen(out_dir) + 1 + base_len + 4;
+    char *name = malloc(len + 1);
+    if (!name) {
+        out_of_memory();
+    }
+    snprintf(name, len + 1, "%s/%.*s.bin", out_dir, (int)base_len, base);
+    return name;
+}
+
+static bool
+write_file(const char *name, const uint8_t *data, size_t len)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = write_all(fd, data, len);
+    return close(fd) == 0 && ok;
+}
+
+// Assembles one input.  Returns false if it could not be assembled.
+static bool
+batch_one(Batch *b, Rvas *ctx, const char *input)
+{
+    Str code;
+    if (!map_file(input, &code)) {
+        return false;
+    }
+    RvasOutput image;
+    int rc = rvas_assemble(ctx, code.data, code.len, &image);
+    atomic_fetch_add(&b->bytes_in, code.len);
+    bool ok = rc == 0;
+    if (ok) {
+        char *name = batch_output_name(b->out_dir, input);
+        ok = write_file(name, image.data, image.len);
+        if (ok) {
+            atomic_fetch_add(&b->bytes_out, image.len);
+        } else {
+            print_error("Could not write %s: %s\n", name, strerror(errno));
+        }
+        free(name);
+    } else {
+        size_t n_diags;
+        const RvasDiag *diags = rvas_diags(ctx, &n_diags);
+        // Keep the errors of a file together.
+        flockfile(stderr);
+        for (size_t i = 0; i < n_diags; i++) {
+            if (diags[i].line) {
+                fprintf(stderr, "%s: line %zu: %s\n", input, diags[i].line,
+                        diags[i].msg);
+            } else {
+                fprintf(stderr, "%s: %s\n", input, diags[i].msg);
+            }
+        }
+        funlockfile(stderr);
+    }
+    if (code.len) {
+        munmap((void *)code.data, code.len);
+    }
+    return ok;
+}
+
+static void *
+batch_run(void *arg)
+{
+    Batch *b = arg;
+    Rvas *ctx = rvas_new();
+    if (!ctx) {
+        out_of_memory();
+    }
+    static const enum RvasTarget targets[] = {
+        [TARGET_RV32] = RVAS_RV32,
+        [TARGET_RV64] = RVAS_RV64,
+        [TARGET_RV32 | TARGET_C] = RVAS_RV32C,
+        [TARGET_RV64 | TARGET_C] = RVAS_RV64C,
+    };
+    rvas_set_target(ctx, targets[b->target]);
+    rvas_allow_incbin(ctx, 1);
+    for (;;) {
+        size_t k = atomic_fetch_add(&b->next, 1);
+        if (k >= b->n_inputs) {
+            break;
+        }
+        if (!batch_one(b, ctx, b->inputs[k])) {
+            atomic_fetch_add(&b->n_failed, 1);
+        }
+    }
+    rvas_free(ctx);
+    return NULL;
+}
+
+// An input and the name of its image, for finding two with the same image.
+struct BatchName {
+    char *name;
+    const char *input;
+};
+typedef struct BatchName BatchName;
+
+static int
+batch_name_cmp(const void *a, const void *b)
+{
+    return strcmp(((const BatchName *)a)->name, ((const BatchName *)b)->name);
+}
+
+// Returns false, after printing them, if two inputs would be written to
+// the same image, such as d1/x.s and d2/x.s.
+static bool
+batch_check_names(const Batch *b)
+{
+    BatchName *names = malloc(b->n_inputs * sizeof *names + 1);
+    if (!names) {
+        out_of_memory();
+    }
+    for (size_t i = 0; i < b->n_inputs; i++) {
+        names[i] = (BatchName){
+            batch_output_name(b->out_dir, b->inputs[i]),
+            b->inputs[i],
+        };
+    }
+    qsort(names, b->n_inputs, sizeof *names, batch_name_cmp);
+    bool ok = true;
+    for (size_t i = 1; i < b->n_inputs; i++) {
+        if (!strcmp(names[i - 1].name, names[i].name)) {
+            print_error("%s and %s would both be written to %s\n",
+                    names[i - 1].input, names[i].input, names[i].name);
+            ok = false;
+        }
+    }
+    for (size_t i = 0; i < b->n_inputs; i++) {
+        free(names[i].name);
+    }
+    free(names);
+    return ok;
+}
+
+// Reads the names of the inputs from a file with one name per line.
+// Returns false if it cannot be read, or if two inputs have the same
+// image.
+static bool
+read_list(const char *list, Batch *b)
+{
+    Str code;
+    if (!map_file(list, &code)) {
+        return false;
+    }
+    size_t cap = 0;
+    const char *p = code.data;
+    const char *end = code.data + code.len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+        if (line_end > p) {
+            b->inputs = grow(b->inputs, &cap, b->n_inputs + 1,
+                    sizeof *b->inputs);
+            b->inputs[b->n_inputs] = strndup(p, line_end - p);
+            if (!b->inputs[b->n_inputs]) {
+                out_of_memory();
+            }
+            b->n_inputs++;
+        }
+        p = line_end + 1;
+    }
+    if (code.len) {
+        munmap((void *)code.data, code.len);
+    }
+    return batch_check_names(b);
+}
+
+// Assembles the files listed in list into out_dir on n_threads threads
+// and prints the throughput.  Returns false if any file failed.
+static bool
+batch(const char *list, const char *out_dir, Target target, int n_threads)
+{
+    Batch b = {.out_dir = out_dir, .target = target};
+    if (!read_list(list, &b)) {
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t n_spawned = b.n_inputs < (size_t)n_threads
+        ? b.n_inputs : (size_t)n_threads;
+    n_spawned = n_spawned ? n_spawned - 1 : 0;
+    pthread_t *threads = malloc(n_spawned * sizeof *threads + 1);
+    if (!threads) {
+        out_of_memory();
+    }
+    for (size_t t = 0; t < n_spawned; t++) {
+        if (pthread_create(&threads[t], NULL, batch_run, &b)) {
+            print_error("Could not start thread.\n");
+            abort();
+        }
+    }
+    batch_run(&b);
+    for (size_t t = 0; t < n_spawned; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+    size_t n_failed = atomic_load(&b.n_failed);
+    uint64_t bytes_in = atomic_load(&b.bytes_in);
+    fprintf(stderr, "%zu files (%zu failed), %llu bytes in, %llu bytes out, "
+            "%.3f s: %.0f files/s, %.1f MB/s\n",
+            b.n_inputs, n_failed, (unsigned long long)bytes_in,
+            (unsigned long long)atomic_load(&b.bytes_out), secs,
+            b.n_inputs / secs, bytes_in / secs / 1e6);
+
+    for (size_t i = 0; i < b.n_inputs; i++) {
+        free(b.inputs[i]);
+    }
+    free(b.inputs);
+    return n_failed == 0;
+}
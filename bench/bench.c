@@ -0,0 +1,297 @@
+// Measures the phases of rvas on assembly files, and compares the
+// results with a saved baseline.
+//
+// Usage: bench [-n runs] [-o results] [-c baseline] [-t percent] file...
+//
+// Every phase is run n times (5) on every file and the fastest run is
+// reported: lexing alone, assembling (lexing, parsing and encoding),
+// resolving the fixups and writing the image to a temporary file.  -o saves the
+// results, and -c compares them with saved ones and fails if a phase got
+// slower by more than the percentage given with -t (5), and by more than
+// 0.1 ms, which is noise.
+//
+// The peak resident size is that of the whole process at the end of a
+// phase, so it includes the earlier files and phases.
+//
+// rvas is built into this program, so the phases are the real functions.
+
+#define RVAS_LIBRARY
+#define RVAS_BENCH
+#include "../rvas.c"
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+enum Phase {
+    PHASE_LEX,
+    PHASE_ASSEMBLE,
+    PHASE_RESOLVE,
+    PHASE_WRITE,
+    N_PHASES,
+};
+typedef enum Phase Phase;
+
+static const char *phase_names[] = {"lex", "assemble", "resolve", "write"};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Peak resident size of the process so far, in MB.
+static double
+peak_rss(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0;
+}
+
+struct Counts {
+    size_t lines;
+    size_t instrs;
+};
+typedef struct Counts Counts;
+
+// Lexes the whole code and counts the lines and the instructions.
+static Counts
+lex_all(Str code)
+{
+    State st = {
+        .code = code,
+        .scanner = scanner(code),
+    };
+    Counts c = {0};
+    while (lex_line(&st)) {
+        c.lines++;
+        const Token *t = st.toks;
+        if (t[0].kind == TOK_NAME
+                && !(t[1].kind == TOK_PUNCT && st.line_start[t[1].start] == ':'))
+        {
+            c.instrs++;
+        }
+    }
+    free(st.toks);
+    return c;
+}
+
+// Runs every phase once, and sets the time each took and the peak
+// resident size of the process at its end.
+static bool
+run(Str code, double times[N_PHASES], double rss[N_PHASES], Counts *counts,
+        int out_fd)
+{
+    double t0 = now();
+    *counts = lex_all(code);
+    double t1 = now();
+    rss[PHASE_LEX] = peak_rss();
+    State st = {
+        .code = code,
+        .scanner = scanner(code),
+    };
+    Output out = {0};
+    assemble(&st, &out, TARGET_RV64);
+    double t2 = now();
+    rss[PHASE_ASSEMBLE] = peak_rss();
+    Relax relax;
+    relax_and_resolve(&st, &out, TARGET_RV64, &relax);
+    relax_free(&relax);
+    double t3 = now();
+    rss[PHASE_RESOLVE] = peak_rss();
+    bool ok = st.n_errors == 0 && ftruncate(out_fd, 0) == 0
+        && lseek(out_fd, 0, SEEK_SET) == 0 && output_write(&out, out_fd);
+    double t4 = now();
+    rss[PHASE_WRITE] = peak_rss();
+    times[PHASE_LEX] = t1 - t0;
+    times[PHASE_ASSEMBLE] = t2 - t1;
+    times[PHASE_RESOLVE] = t3 - t2;
+    times[PHASE_WRITE] = t4 - t3;
+
+    state_free(&st);
+    for (size_t i = 0; i < st.n_errors; i++) {
+        free(st.diags[i].msg);
+    }
+    free(st.diags);
+    output_free(&out);
+    return ok;
+}
+
+struct Result {
+    char *file;
+    Phase phase;
+    double secs;
+};
+typedef struct Result Result;
+
+static Result *results;
+static size_t n_results;
+static size_t cap_results;
+
+static void
+add_result(const char *file, Phase phase, double secs)
+{
+    results = grow(results, &cap_results, n_results + 1, sizeof *results);
+    results[n_results++] = (Result){strdup(file), phase, secs};
+}
+
+static bool
+read_file(const char *name, Str *code)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "Could not open %s\n", name);
+        return false;
+    }
+    code->len = sb.st_size;
+    code->data = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+            fd, 0) : "";
+    close(fd);
+    if (code->data == MAP_FAILED) {
+        fprintf(stderr, "Could not read %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+static bool
+bench_file(const char *name, int n_runs, int out_fd)
+{
+    Str code;
+    if (!read_file(name, &code)) {
+        return false;
+    }
+    double best[N_PHASES];
+    double rss[N_PHASES];
+    Counts counts = {0};
+    for (int r = 0; r < n_runs; r++) {
+        double times[N_PHASES];
+        if (!run(code, times, rss, &counts, out_fd)) {
+            fprintf(stderr, "%s: does not assemble\n", name);
+            return false;
+        }
+        for (int p = 0; p < N_PHASES; p++) {
+            if (r == 0 || times[p] < best[p]) {
+                best[p] = times[p];
+            }
+        }
+    }
+
+    printf("%s: %zu bytes, %zu lines, %zu instructions\n", name, code.len,
+            counts.lines, counts.instrs);
+    printf("  %-10s %12s %10s %12s %10s\n", "phase", "lines/s", "MB/s",
+            "ns/instr", "peak MB");
+    for (int p = 0; p < N_PHASES; p++) {
+        double t = best[p] > 0 ? best[p] : 1e-9;
+        printf("  %-10s %12.0f %10.1f %12.2f %10.1f\n", phase_names[p],
+                counts.lines / t, code.len / t / 1e6,
+                counts.instrs ? t * 1e9 / counts.instrs : 0.0, rss[p]);
+        add_result(name, p, best[p]);
+    }
+    return true;
+}
+
+static bool
+save_results(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+    for (size_t i = 0; i < n_results; i++) {
+        fprintf(f, "%s %s %.9f\n", results[i].file,
+                phase_names[results[i].phase], results[i].secs);
+    }
+    return fclose(f) == 0;
+}
+
+// Compares the results with the baseline at path.  Returns false if a
+// phase got slower by more than threshold percent.
+static bool
+compare_results(const char *path, double threshold)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not read %s\n", path);
+        return false;
+    }
+    bool ok = true;
+    char file[4096];
+    char phase[32];
+    double secs;
+    while (fscanf(f, "%4095s %31s %lf", file, phase, &secs) == 3) {
+        for (size_t i = 0; i < n_results; i++) {
+            const Result *r = &results[i];
+            if (strcmp(r->file, file) || strcmp(phase_names[r->phase], phase)) {
+                continue;
+            }
+            double change = (r->secs / secs - 1) * 100;
+            bool slower = change > threshold && r->secs - secs > 1e-4;
+            printf("%s %-10s %+7.1f%%%s\n", file, phase, change,
+                    slower ? "  REGRESSION" : "");
+            ok = ok && !slower;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+    int n_runs = 5;
+    const char *save = NULL;
+    const char *baseline = NULL;
+    double threshold = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:c:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_runs = atoi(optarg);
+            break;
+        case 'o':
+            save = optarg;
+            break;
+        case 'c':
+            baseline = optarg;
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: bench [-n runs] [-o results]"
+                    " [-c baseline] [-t percent] file...\n");
+            return 1;
+        }
+    }
+    if (optind == argc || n_runs < 1) {
+        fprintf(stderr, "Usage: bench [-n runs] [-o results]"
+                " [-c baseline] [-t percent] file...\n");
+        return 1;
+    }
+    isa_init();
+    names_init();
+    FILE *tmp = tmpfile();
+    if (!tmp) {
+        fprintf(stderr, "Could not create a temporary file\n");
+        return 1;
+    }
+    int out_fd = fileno(tmp);
+    for (int i = optind; i < argc; i++) {
+        if (!bench_file(argv[i], n_runs, out_fd)) {
+            return 1;
+        }
+    }
+    if (save && !save_results(save)) {
+        return 1;
+    }
+    if (baseline && !compare_results(baseline, threshold)) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Generates RV64 assembly for benchmarking rvas.  The output depends only
+// on the options, so a size and a seed always give the same program.
+//
+// Usage: gen [options] size
+//
+// The size is in bytes, with an optional K, M or G suffix.  The options
+// are:
+//
+//     -s seed     seed of the generator (1)
+//     -l n        labels per 1000 lines (50)
+//     -f n        percent of the branches that go forward (50)
+//     -e n        .equ constants per 1000 lines, used by later lines (5)
+//     -d n        .db lines per 1000 lines (10)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t rng_state;
+
+static uint64_t
+rng(void)
+{
+    // splitmix64
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static unsigned
+rnd(unsigned n)
+{
+    return rng() % n;
+}
+
+static const char *regs[] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0",
+    "a1", "a2", "a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4", "s5", "s6",
+    "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+
+static const char *
+reg(void)
+{
+    return regs[rnd(32)];
+}
+
+static const char *rrr[] = {
+    "add", "sub", "sll", "slt", "sltu", "xor", "srl", "sra", "or", "and",
+    "addw", "subw", "sllw", "srlw", "sraw",
+};
+static const char *rri[] = {
+    "addi", "slti", "sltiu", "xori", "ori", "andi", "addiw",
+};
+static const char *shifts[] = {"slli", "srli", "srai"};
+static const char *loads[] = {"lb", "lh", "lw", "ld", "lbu", "lhu", "lwu"};
+static const char *stores[] = {"sb", "sh", "sw", "sd"};
+static const char *branches[] = {"beq", "bne", "blt", "bge", "bltu", "bgeu"};
+static const char *csrs[] = {"mstatus", "mtvec", "mepc", "mcause", "cycle"};
+
+#define PICK(a) (a)[rnd(sizeof (a) / sizeof *(a))]
+
+static unsigned long long
+parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (*end == 'K') {
+        n <<= 10;
+    } else if (*end == 'M') {
+        n <<= 20;
+    } else if (*end == 'G') {
+        n <<= 30;
+    }
+    return n;
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t seed = 1;
+    unsigned label_rate = 50;
+    unsigned forward_pct = 50;
+    unsigned equ_rate = 5;
+    unsigned db_rate = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:f:e:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            label_rate = atoi(optarg);
+            break;
+        case 'f':
+            forward_pct = atoi(optarg);
+            break;
+        case 'e':
+            equ_rate = atoi(optarg);
+            break;
+        case 'd':
+            db_rate = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: gen [-s seed] [-l labels] [-f forward]"
+                    " [-e equs] [-d dbs] size\n");
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Usage: gen [-s seed] [-l labels] [-f forward]"
+                " [-e equs] [-d dbs] size\n");
+        return 1;
+    }
+    unsigned long long size = parse_size(argv[optind]);
+    rng_state = seed;
+
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof buf);
+
+    // Labels are numbered in the order they are defined.  A forward
+    // branch goes to one of the next few labels, so all of them must be
+    // defined before the end.
+    unsigned long long n_labels = 0;
+    unsigned long long max_ref = 0;
+    unsigned long long n_equs = 0;
+    unsigned long long written = 0;
+    while (written < size || n_labels <= max_ref) {
+        char line[128];
+        int len;
+        unsigned kind = rnd(1000);
+        if (kind < label_rate || (written >= size && n_labels <= max_ref)) {
+            len = snprintf(line, sizeof line, "L%llu:\n", n_labels++);
+        } else if (kind < label_rate + equ_rate) {
+            len = snprintf(line, sizeof line, ".equ C%llu, %u\n", n_equs++,
+                    rnd(2048));
+        } else if (kind < label_rate + equ_rate + db_rate) {
+            // 12 bytes, so the code after it stays aligned.
+            len = snprintf(line, sizeof line, "    .db \"data %07u\"\n",
+                    rnd(100000));
+        } else {
+            unsigned k = rnd(100);
+            if (k < 30) {
+                len = snprintf(line, sizeof line, "    %s %s, %s, %s\n",
+                        PICK(rrr), reg(), reg(), reg());
+            } else if (k < 45) {
+                if (n_equs && rnd(4) == 0) {
+                    len = snprintf(line, sizeof line,
+                            "    %s %s, %s, C%llu\n", PICK(rri), reg(),
+                            reg(), rng() % n_equs);
+                } else {
+                    len = snprintf(line, sizeof line, "    %s %s, %s, %d\n",
+                            PICK(rri), reg(), reg(), (int)rnd(4096) - 2048);
+                }
+            } else if (k < 50) {
+                len = snprintf(line, sizeof line, "    %s %s, %s, %u\n",
+                        PICK(shifts), reg(), reg(), rnd(64));
+            } else if (k < 62) {
+                len = snprintf(line, sizeof line, "    %s %s, %d(%s)\n",
+                        PICK(loads), reg(), (int)rnd(4096) - 2048, reg());
+            } else if (k < 70) {
+                len = snprintf(line, sizeof line, "    %s %s, %d(%s)\n",
+                        PICK(stores), reg(), (int)rnd(4096) - 2048, reg());
+            } else if (k < 90) {
+                unsigned long long target;
+                if (!n_labels || rnd(100) < forward_pct) {
+                    target = n_labels + rnd(8);
+                    if (target > max_ref) {
+                        max_ref = target;
+                    }
+                } else {
+                    target = n_labels - 1 - rnd(n_labels < 8 ? n_labels : 8);
+                }
+                if (rnd(4) == 0) {
+                    len = snprintf(line, sizeof line, "    jal %s, L%llu\n",
+                            reg(), target);
+                } else {
+                    len = snprintf(line, sizeof line,
+                            "    %s %s, %s, L%llu\n", PICK(branches), reg(),
+                            reg(), target);
+                }
+            } else if (k < 95) {
+                len = snprintf(line, sizeof line, "    %s %s, 0x%x\n",
+                        rnd(2) ? "lui" : "auipc", reg(), rnd(1 << 20));
+            } else if (k < 98) {
+                len = snprintf(line, sizeof line, "    csrrw %s, %s, %s\n",
+                        reg(), PICK(csrs), reg());
+            } else {
+                len = snprintf(line, sizeof line, "    ; comment %u\n",
+                        rnd(1000));
+            }
+        }
+        fwrite(line, 1, len, stdout);
+        written += len;
+    }
+    return fflush(stdout) ? 1 : 0;
+}
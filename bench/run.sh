@@ -0,0 +1,27 @@
+#!/bin/sh
+# Builds the benchmark, generates the standard inputs and measures them.
+#
+# Usage: bench/run.sh [save|compare] [baseline]
+#
+# With save, the results are written to the baseline file
+# (bench/baseline.txt); with compare, they are checked against it and the
+# script fails on a regression.
+
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+$CC $CFLAGS gen.c -o gen
+$CC $CFLAGS bench.c -o bench -pthread
+
+mkdir -p inputs
+for size in 1M 10M 100M; do
+    [ -f inputs/$size.s ] || ./gen $size > inputs/$size.s
+done
+
+baseline=${2:-baseline.txt}
+case $1 in
+save) ./bench -o "$baseline" inputs/*.s ;;
+compare) ./bench -c "$baseline" inputs/*.s ;;
+*) ./bench inputs/*.s ;;
+esac
@@ -0,0 +1,277 @@
+// A cache of assembled images in a directory, keyed by a hash of the
+// input and of everything else the image depends on.  Several rvas
+// processes can share one: an image is written to a temporary file and
+// renamed into place, so a reader sees either the whole image or none.
+// Hits touch the file, so trimming the cache removes the images that
+// were used least recently.
+//
+// The hash is fast rather than cryptographic: the cache must only be
+// shared by users that trust each other.
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Changes whenever the same input could give a different image.
+#define CACHE_VERSION 2
+
+struct CacheKey {
+    uint64_t h[2];
+};
+typedef struct CacheKey CacheKey;
+
+static uint64_t
+cache_mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * 0x9fb21c651e98df25ULL;
+    return h ^ (h >> 28);
+}
+
+// Hashes data into the key.  Four independent lanes of eight bytes each
+// keep the multipliers busy, so big inputs hash at memory speed.
+static void
+cache_hash(CacheKey *key, const char *data, size_t len)
+{
+    uint64_t lane[4] = {
+        key->h[0], key->h[1], key->h[0] ^ 0x94d049bb133111ebULL,
+        key->h[1] ^ 0xbf58476d1ce4e5b9ULL,
+    };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t w;
+            memcpy(&w, data + i + 8 * k, 8);
+            lane[k] = cache_mix(lane[k], w);
+        }
+    }
+    uint64_t tail[4] = {0};
+    memcpy(tail, data + i, len - i);
+    for (int k = 0; k < 4; k++) {
+        lane[k] = cache_mix(lane[k], tail[k]);
+    }
+    key->h[0] = cache_mix(cache_mix(lane[0], lane[1]), len);
+    key->h[1] = cache_mix(cache_mix(lane[2], lane[3]), key->h[0]);
+}
+
+static CacheKey
+cache_key(const Source *sources, size_t n_sources, Target target)
+{
+    CacheKey key = {{CACHE_VERSION, target}};
+    for (size_t i = 0; i < n_sources; i++) {
+        cache_hash(&key, sources[i].code.data, sources[i].code.len);
+    }
+    return key;
+}
+
+// Returns the path of the image with the key, or of a temporary file for
+// it if tmp is true.
+static char *
+cache_path(const char *dir, CacheKey key, bool tmp)
+{
+    size_t len = strlen(dir) + 64;
+    char *path = malloc(len);
+    if (!path) {
+        out_of_memory();
+    }
+    snprintf(path, len, "%s/%s%016llx%016llx%s", dir, tmp ? ".tmp-" : "",
+            (unsigned long long)key.h[0], (unsigned long long)key.h[1],
+            tmp ? "-XXXXXX" : "");
+    return path;
+}
+
+static bool
+write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+enum CacheLookup {
+    CACHE_MISS,
+    CACHE_HIT,
+    CACHE_WRITE_FAILED,  // Part of the image may have been written.
+};
+typedef enum CacheLookup CacheLookup;
+
+// Writes the cached image with the key to out_fd, and stores its size in
+// *len.
+static CacheLookup
+cache_lookup(const char *dir, CacheKey key, int out_fd, uint64_t *len)
+{
+    char *path = cache_path(dir, key, false);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        return CACHE_MISS;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return CACHE_MISS;
+    }
+    CacheLookup found = CACHE_HIT;
+    if (sb.st_size) {
+        void *data = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            found = CACHE_MISS;
+        } else {
+            if (!write_all(out_fd, data, sb.st_size)) {
+                found = CACHE_WRITE_FAILED;
+            }
+            munmap(data, sb.st_size);
+        }
+    }
+    // Mark it as used for cache_trim.
+    futimens(fd, NULL);
+    close(fd);
+    *len = sb.st_size;
+    return found;
+}
+
+// Opens a temporary file for an image, and returns its fd, or -1 if the
+// image cannot be cached.  *tmp_path gets its path.
+static int
+cache_insert_begin(const char *dir, CacheKey key, char **tmp_path)
+{
+    *tmp_path = cache_path(dir, key, true);
+    int fd = mkstemp(*tmp_path);
+    if (fd == -1) {
+        free(*tmp_path);
+        *tmp_path = NULL;
+        return -1;
+    }
+    // mkstemp makes the file private, but other users may share the cache.
+    fchmod(fd, 0644);
+    return fd;
+}
+
+// Puts the image written to the temporary file in place, or removes the
+// file if ok is false.
+static void
+cache_insert_end(const char *dir, CacheKey key, int fd, char *tmp_path,
+        bool ok)
+{
+    if (fd == -1) {
+        return;
+    }
+    ok = close(fd) == 0 && ok;
+    if (ok) {
+        char *path = cache_path(dir, key, false);
+        ok = rename(tmp_path, path) == 0;
+        free(path);
+    }
+    if (!ok) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+struct CacheEntry {
+    char *name;
+    off_t size;
+    struct timespec used;
+};
+typedef struct CacheEntry CacheEntry;
+
+static int
+cache_entry_cmp(const void *a, const void *b)
+{
+    const CacheEntry *ea = a;
+    const CacheEntry *eb = b;
+    if (ea->used.tv_sec != eb->used.tv_sec) {
+        return ea->used.tv_sec < eb->used.tv_sec ? -1 : 1;
+    }
+    return (ea->used.tv_nsec > eb->used.tv_nsec)
+        - (ea->used.tv_nsec < eb->used.tv_nsec);
+}
+
+// Temporary files older than this were left by a process that died.
+#define CACHE_TMP_MAX_AGE (60 * 60)
+
+// Removes the least recently used images until the cache takes at most
+// max_size bytes.
+static bool
+cache_trim(const char *dir, uint64_t max_size)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        print_error("Could not open %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    CacheEntry *entries = NULL;
+    size_t n_entries = 0;
+    size_t cap_entries = 0;
+    uint64_t total = 0;
+    struct dirent *de;
+    time_t now = time(NULL);
+    while ((de = readdir(d))) {
+        struct stat sb;
+        if (fstatat(dirfd(d), de->d_name, &sb, 0) == -1
+                || !S_ISREG(sb.st_mode))
+        {
+            continue;
+        }
+        if (!strncmp(de->d_name, ".tmp-", 5)) {
+            if (now - sb.st_mtime > CACHE_TMP_MAX_AGE) {
+                unlinkat(dirfd(d), de->d_name, 0);
+            }
+            continue;
+        }
+        entries = grow(entries, &cap_entries, n_entries + 1,
+                sizeof *entries);
+        char *name = strdup(de->d_name);
+        if (!name) {
+            out_of_memory();
+        }
+        entries[n_entries++] = (CacheEntry){name, sb.st_size, sb.st_mtim};
+        total += sb.st_size;
+    }
+
+    qsort(entries, n_entries, sizeof *entries, cache_entry_cmp);
+    for (size_t i = 0; i < n_entries; i++) {
+        if (total > max_size && unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+            total -= entries[i].size;
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(d);
+    return true;
+}
+
+// Parses a size like 4096, 512K, 100M or 2G.
+static bool
+parse_size(const char *s, uint64_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno || end == s) {
+        return false;
+    }
+    int shift = 0;
+    if (*end == 'K') {
+        shift = 10;
+    } else if (*end == 'M') {
+        shift = 20;
+    } else if (*end == 'G') {
+        shift = 30;
+    }
+    if (shift) {
+        n <<= shift;
+        end++;
+    }
+    *size = n;
+    return *end == 0;
+}
@@ -0,0 +1,403 @@
+// The 16-bit forms of the instructions, from the C extension.
+//
+// An instruction is compiled to its 32-bit form as always and then looked
+// at again: if the target has the C extension and the operands fit one of
+// the 16-bit forms, that is emitted instead.  Only instructions whose
+// immediate is known are compressed here.  The branches and jals to
+// labels are made short by relaxation, which knows where the labels end
+// up.  A c. mnemonic is compiled the same way, as the instruction it
+// stands for, and it is an error if that does not fit.
+
+// Whether the register is one of x8 to x15, the only ones that the 3-bit
+// register fields of most 16-bit forms can name.
+static bool
+is_creg(Reg r)
+{
+    return r >= REG_S0 && r <= REG_A5;
+}
+
+static bool
+fits_imm6(int32_t imm)
+{
+    return imm >= -32 && imm < 32;
+}
+
+static uint32_t
+instr_type_ci(Reg rd, int32_t imm)
+{
+    return bits(imm, 5, 5) << 12 | rd << 7 | bits(imm, 4, 0) << 2;
+}
+
+static uint32_t
+instr_type_ca(Reg rd, Reg rs2)
+{
+    return (rd - REG_S0) << 7 | (rs2 - REG_S0) << 2;
+}
+
+static uint32_t
+instr_type_cb(Reg rs1, int32_t imm)
+{
+    return bits(imm, 8, 8) << 12
+        |  bits(imm, 4, 3) << 10
+        |  (rs1 - REG_S0) << 7
+        |  bits(imm, 7, 6) << 5
+        |  bits(imm, 2, 1) << 3
+        |  bits(imm, 5, 5) << 2;
+}
+
+static uint32_t
+instr_type_cj(int32_t imm)
+{
+    return bits(imm, 11, 11) << 12
+        |  bits(imm, 4, 4) << 11
+        |  bits(imm, 9, 8) << 9
+        |  bits(imm, 10, 10) << 8
+        |  bits(imm, 6, 6) << 7
+        |  bits(imm, 7, 7) << 6
+        |  bits(imm, 3, 1) << 3
+        |  bits(imm, 5, 5) << 2;
+}
+
+// The offset of a load or store of a word, or of a doubleword if wide,
+// from a register of x8 to x15.
+static uint32_t
+instr_type_cl(Reg rd, Reg rs1, int32_t imm, bool wide)
+{
+    uint32_t low = wide
+        ? bits(imm, 7, 6) << 5
+        : bits(imm, 2, 2) << 6 | bits(imm, 6, 6) << 5;
+    return bits(imm, 5, 3) << 10 | (rs1 - REG_S0) << 7 | low
+        | (rd - REG_S0) << 2;
+}
+
+// Whether the offset fits a load or store of a word, or of a doubleword
+// if wide, whose offset has scale times as many values as in c.lw.
+static bool
+fits_mem_offset(int32_t imm, bool wide, int scale)
+{
+    int size = wide ? 8 : 4;
+    return imm >= 0 && imm < 32 * size * scale && imm % size == 0;
+}
+
+static uint32_t
+instr_addi16sp(int32_t imm)
+{
+    return 0x6101  // c.addi16sp
+        | bits(imm, 9, 9) << 12 | bits(imm, 4, 4) << 6
+        | bits(imm, 6, 6) << 5 | bits(imm, 8, 7) << 3
+        | bits(imm, 5, 5) << 2;
+}
+
+// Returns the 16-bit form of the instruction, or the instruction itself
+// if it has none on the target.
+static uint32_t
+compress_instr(uint32_t instr, Target target)
+{
+    bool rv64 = target & TARGET_RV64;
+    Reg rd = bits(instr, 11, 7);
+    Reg rs1 = bits(instr, 19, 15);
+    Reg rs2 = bits(instr, 24, 20);
+    uint32_t funct3 = bits(instr, 14, 12);
+    uint32_t funct7 = bits(instr, 31, 25);
+    int32_t imm = (int32_t)instr >> 20;
+    switch (instr & 0x7f) {
+    case 0x13:
+        if (funct3 == 0) {
+            if (rd == REG_ZERO && rs1 == REG_ZERO && imm == 0) {
+                return 0x0001;  // c.nop
+            }
+            if (rd != REG_ZERO && rs1 == rd && imm != 0 && fits_imm6(imm)) {
+                return 0x0001 | instr_type_ci(rd, imm);  // c.addi
+            }
+            if (rd == REG_SP && rs1 == REG_SP && imm != 0 && imm % 16 == 0
+                    && imm >= -512 && imm < 512)
+            {
+                return instr_addi16sp(imm);
+            }
+            if (is_creg(rd) && rs1 == REG_SP && imm > 0 && imm < 1024
+                    && imm % 4 == 0)
+            {
+                return 0x0000  // c.addi4spn
+                    | bits(imm, 5, 4) << 11 | bits(imm, 9, 6) << 7
+                    | bits(imm, 2, 2) << 6 | bits(imm, 3, 3) << 5
+                    | (rd - REG_S0) << 2;
+            }
+            if (rd != REG_ZERO && rs1 == REG_ZERO && fits_imm6(imm)) {
+                return 0x4001 | instr_type_ci(rd, imm);  // c.li
+            }
+            if (rd != REG_ZERO && rs1 != REG_ZERO && imm == 0) {
+                return 0x8002 | rd << 7 | rs1 << 2;  // c.mv
+            }
+        } else if (funct3 == 1) {
+            uint32_t shamt = bits(instr, 25, 20);
+            if (rd != REG_ZERO && rs1 == rd && shamt != 0
+                    && bits(instr, 31, 26) == 0)
+            {
+                return 0x0002 | instr_type_ci(rd, shamt);  // c.slli
+            }
+        } else if (funct3 == 5) {
+            uint32_t shamt = bits(instr, 25, 20);
+            uint32_t top = bits(instr, 31, 26);
+            if (is_creg(rd) && rs1 == rd && shamt != 0
+                    && (top == 0 || top == 0x10))
+            {
+                return (top ? 0x8401 : 0x8001)  // c.srai, c.srli
+                    | bits(shamt, 5, 5) << 12 | (rd - REG_S0) << 7
+                    | bits(shamt, 4, 0) << 2;
+            }
+        } else if (funct3 == 7) {
+            if (is_creg(rd) && rs1 == rd && fits_imm6(imm)) {
+                return 0x8801  // c.andi
+                    | bits(imm, 5, 5) << 12 | (rd - REG_S0) << 7
+                    | bits(imm, 4, 0) << 2;
+            }
+        }
+        break;
+    case 0x1b:
+        if (rv64 && funct3 == 0 && rd != REG_ZERO && rs1 == rd
+                && fits_imm6(imm))
+        {
+            return 0x2001 | instr_type_ci(rd, imm);  // c.addiw
+        }
+        // Adding to zero sets the same value on either width.
+        if (funct3 == 0 && rd != REG_ZERO && rs1 == REG_ZERO
+                && fits_imm6(imm))
+        {
+            return 0x4001 | instr_type_ci(rd, imm);  // c.li
+        }
+        break;
+    case 0x33:
+        if (funct7 == 0 && funct3 == 0 && rd != REG_ZERO
+                && (rs1 != REG_ZERO || rs2 != REG_ZERO))
+        {
+            if (rs1 == REG_ZERO || rs2 == REG_ZERO) {
+                Reg rs = rs1 | rs2;
+                return 0x8002 | rd << 7 | rs << 2;  // c.mv
+            }
+            if (rs1 == rd || rs2 == rd) {
+                Reg other = rs1 == rd ? rs2 : rs1;
+                return 0x9002 | rd << 7 | other << 2;  // c.add
+            }
+        } else if (funct7 == 0x20 && funct3 == 0) {
+            if (is_creg(rd) && rs1 == rd && is_creg(rs2)) {
+                return 0x8c01 | instr_type_ca(rd, rs2);  // c.sub
+            }
+        } else if (funct7 == 0 && (funct3 == 4 || funct3 == 6
+                    || funct3 == 7))
+        {
+            // c.xor, c.or and c.and, either way round.
+            uint32_t match = funct3 == 4 ? 0x8c21
+                : funct3 == 6 ? 0x8c41 : 0x8c61;
+            if (is_creg(rd) && rs1 == rd && is_creg(rs2)) {
+                return match | instr_type_ca(rd, rs2);
+            }
+            if (is_creg(rd) && rs2 == rd && is_creg(rs1)) {
+                return match | instr_type_ca(rd, rs1);
+            }
+        }
+        break;
+    case 0x3b:
+        if (!rv64 || funct3 != 0 || !is_creg(rd)) {
+            break;
+        }
+        if (funct7 == 0x20 && rs1 == rd && is_creg(rs2)) {
+            return 0x9c01 | instr_type_ca(rd, rs2);  // c.subw
+        }
+        if (funct7 == 0 && rs1 == rd && is_creg(rs2)) {
+            return 0x9c21 | instr_type_ca(rd, rs2);  // c.addw
+        }
+        if (funct7 == 0 && rs2 == rd && is_creg(rs1)) {
+            return 0x9c21 | instr_type_ca(rd, rs1);
+        }
+        break;
+    case 0x03: {
+        bool wide = funct3 == 3;
+        if (funct3 != 2 && !(wide && rv64)) {
+            break;
+        }
+        if (is_creg(rd) && is_creg(rs1) && fits_mem_offset(imm, wide, 1)) {
+            return (wide ? 0x6000 : 0x4000)  // c.ld, c.lw
+                | instr_type_cl(rd, rs1, imm, wide);
+        }
+        if (rd != REG_ZERO && rs1 == REG_SP
+                && fits_mem_offset(imm, wide, 2))
+        {
+            uint32_t low = wide
+                ? bits(imm, 4, 3) << 5 | bits(imm, 8, 6) << 2
+                : bits(imm, 4, 2) << 4 | bits(imm, 7, 6) << 2;
+            return (wide ? 0x6002 : 0x4002)  // c.ldsp, c.lwsp
+                | bits(imm, 5, 5) << 12 | rd << 7 | low;
+        }
+        break;
+    }
+    case 0x23: {
+        bool wide = funct3 == 3;
+        imm = (int32_t)(instr & 0xfe000000) >> 20 | rd;
+        if (funct3 != 2 && !(wide && rv64)) {
+            break;
+        }
+        if (is_creg(rs2) && is_creg(rs1) && fits_mem_offset(imm, wide, 1)) {
+            return (wide ? 0xe000 : 0xc000)  // c.sd, c.sw
+                | instr_type_cl(rs2, rs1, imm, wide);
+        }
+        if (rs1 == REG_SP && fits_mem_offset(imm, wide, 2)) {
+            uint32_t offset = wide
+                ? bits(imm, 5, 3) << 10 | bits(imm, 8, 6) << 7
+                : bits(imm, 5, 2) << 9 | bits(imm, 7, 6) << 7;
+            return (wide ? 0xe002 : 0xc002)  // c.sdsp, c.swsp
+                | offset | rs2 << 2;
+        }
+        break;
+    }
+    case 0x37: {
+        int32_t hi = (int32_t)instr >> 12;
+        if (rd != REG_ZERO && rd != REG_SP && hi != 0 && fits_imm6(hi)) {
+            return 0x6001 | instr_type_ci(rd, hi);  // c.lui
+        }
+        break;
+    }
+    case 0x6f: {
+        int32_t offset = (int32_t)(bits(instr, 31, 31) << 20
+                | bits(instr, 19, 12) << 12 | bits(instr, 20, 20) << 11
+                | bits(instr, 30, 21) << 1) << 11 >> 11;
+        if (offset < -2048 || offset >= 2048) {
+            break;
+        }
+        if (rd == REG_ZERO) {
+            return 0xa001 | instr_type_cj(offset);  // c.j
+        }
+        if (rd == REG_RA && !rv64) {
+            return 0x2001 | instr_type_cj(offset);  // c.jal
+        }
+        break;
+    }
+    case 0x67:
+        if (funct3 == 0 && imm == 0 && rs1 != REG_ZERO
+                && (rd == REG_ZERO || rd == REG_RA))
+        {
+            return (rd ? 0x9002 : 0x8002) | rs1 << 7;  // c.jalr, c.jr
+        }
+        break;
+    case 0x63: {
+        int32_t offset = (int32_t)(bits(instr, 31, 31) << 12
+                | bits(instr, 7, 7) << 11 | bits(instr, 30, 25) << 5
+                | bits(instr, 11, 8) << 1) << 19 >> 19;
+        if (funct3 <= 1 && rs2 == REG_ZERO && is_creg(rs1)
+                && offset >= -256 && offset < 256)
+        {
+            return (funct3 ? 0xe001 : 0xc001)  // c.bnez, c.beqz
+                | instr_type_cb(rs1, offset);
+        }
+        break;
+    }
+    case 0x73:
+        if (instr == 0x00100073) {
+            return 0x9002;  // c.ebreak
+        }
+        break;
+    }
+    return instr;
+}
+
+// Returns the instruction in its 16-bit form if the target has the C
+// extension and the instruction has a 16-bit form with its immediate.
+static CompiledInstr
+compress(CompiledInstr instr, Target target)
+{
+    if (target & TARGET_C && !instr.replace_imm) {
+        instr.instr = compress_instr(instr.instr, target);
+    }
+    return instr;
+}
+
+// Turns the instruction that a c. mnemonic stands for into its 16-bit
+// form, or reports that its operands do not fit it.  A branch or jal to
+// a label becomes one with a fixup of its own kind, which is never made
+// longer.
+static CompiledInstr
+compress_mnemonic(State *st, const Instr *in, CompiledInstr instr,
+        Target target)
+{
+    uint32_t c = compress_instr(instr.instr, target);
+    int32_t imm = (int32_t)instr.instr >> 20;
+    if (in->form == 0x6001 && (c & 0xe003) == 0x0001
+            && bits(c, 11, 7) == REG_SP && imm % 16 == 0)
+    {
+        // The few immediates that c.addi16sp and c.addi both take make
+        // c.addi.
+        c = instr_addi16sp(imm);
+    }
+    // c.mv and c.add differ in bit 12 only.
+    uint32_t mask = (in->form & 0xe003) == 0x8002 ? 0xf003 : 0xe003;
+    if ((c & mask) != in->form) {
+        error(st, "Operands do not fit %s", in->name);
+        return instr;
+    }
+    if (instr.replace_imm) {
+        if (instr.fixup.kind == FIXUP_B) {
+            instr.fixup.kind = FIXUP_CB;
+        } else if (instr.fixup.kind == FIXUP_J) {
+            instr.fixup.kind = FIXUP_CJ;
+        } else {
+            Str name = st->symtab.syms[instr.fixup.sym].name;
+            error(st, "Expected a constant: %.*s", (int)name.len, name.data);
+            return instr;
+        }
+    }
+    instr.instr = c;
+    return instr;
+}
+
+// Compiles the operands of the c. mnemonics that are not written as those
+// of the instruction they stand for.  The registers that the instruction
+// implies are in its match.
+static CompiledInstr
+compile_instr_c(State *st, const Instr *in)
+{
+    Reg rd = REG_ZERO;
+    if (in->format != FMT_C_J && in->format != FMT_C_JR) {
+        rd = read_reg(st);
+        expect(st, ',');
+    }
+    switch (in->format) {
+    case FMT_C_RR:
+        return (CompiledInstr) {
+            .instr = instr_type_r(rd, rd, read_reg(st)) | in->match,
+        };
+    case FMT_C_MV:
+        return (CompiledInstr) {
+            .instr = instr_type_r(rd, REG_ZERO, read_reg(st)) | in->match,
+        };
+    case FMT_C_RI:
+    case FMT_C_LI: {
+        Reg rs1 = in->format == FMT_C_RI ? rd : REG_ZERO;
+        Expr e = read_const_expr(st);
+        return (CompiledInstr) {
+            .instr = instr_type_i(rd, rs1, e.result) | in->match,
+        };
+    }
+    case FMT_C_JR:
+        return (CompiledInstr) {
+            .instr = instr_type_i(REG_ZERO, read_reg(st), 0) | in->match,
+        };
+    case FMT_C_J:
+    case FMT_C_BZ: {
+        bool is_branch = in->format == FMT_C_BZ;
+        Expr e = read_expr(st);
+        int32_t imm = e.known ? e.result : 0;
+        return (CompiledInstr) {
+            .instr = (is_branch ? instr_type_b(rd, REG_ZERO, imm)
+                    : instr_type_j(REG_ZERO, imm)) | in->match,
+            .replace_imm = !e.known,
+            .fixup = {
+                .kind = expr_fixup_kind(st, &e,
+                        is_branch ? FIXUP_B : FIXUP_J),
+                .sym = e.known ? 0 : e.sym,
+            },
+        };
+    }
+    default:
+        assert(false);
+        return (CompiledInstr){0};
+    }
+}
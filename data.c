@@ -0,0 +1,204 @@
+// Data: the values of .half, .word and .dword, and the runs of bytes of
+// .zero and .fill.
+//
+// A value that is a label is a fixup like the immediate of an instruction,
+// and is filled in when the labels are known.  The runs are written a
+// block at a time instead of a value at a time.
+
+// Emits a value of the size of a fixup of the kind, and records its fixup
+// if it is not known yet.
+static void
+emit_data(Output *out, State *st, FixupKind kind, Expr e)
+{
+    int size = fixup_size(kind);
+    uint64_t value = e.known ? e.result : 0;
+    if (!e.known) {
+        add_fixup(st, (Fixup) {
+            .offset = out->output_len,
+            .sym = e.sym,
+            .kind = kind,
+        });
+    }
+    uint8_t *p = output_reserve(out, size);
+    for (int i = 0; i < size; i++) {
+        p[i] = value >> 8 * i;
+    }
+    st->pc += size;
+}
+
+// .half, .word and .dword take any number of values separated by commas,
+// of 2, 4 and 8 bytes, which are the kind's size.
+static void
+compile_data(Output *out, State *st, FixupKind kind)
+{
+    for (;;) {
+        Expr e = read_expr(st);
+        // Only reports a relocation, which data cannot have.
+        expr_fixup_kind(st, &e, kind);
+        emit_data(out, st, kind, e);
+        if (!is_punct(st, peek_token(st), ',')) {
+            break;
+        }
+        read_token(st);
+    }
+}
+
+// Emits count copies of the lowest size bytes of value.
+static void
+emit_fill(Output *out, State *st, uint64_t count, int size, uint64_t value)
+{
+    uint8_t pattern[8] = {0};
+    bool same = true;
+    for (int i = 0; i < size; i++) {
+        pattern[i] = value >> 8 * i;
+        same &= pattern[i] == pattern[0];
+    }
+    uint64_t len = count * size;
+    st->pc += len;
+    if (same) {
+        output_fill(out, pattern[0], len);
+        return;
+    }
+    uint8_t block[4096];
+    size_t n = sizeof block / size * size;
+    for (size_t i = 0; i < n; i++) {
+        block[i] = pattern[i % size];
+    }
+    while (len) {
+        size_t k = len < n ? len : n;
+        output_bytes(out, block, k);
+        len -= k;
+    }
+}
+
+// .zero count emits count zero bytes, and .fill count[, size[, value]]
+// count copies of the lowest size bytes of value, which are 1 and 0 if
+// they are left out.  As in GNU as, value has 32 bits, and the bytes
+// above them are 0.
+static void
+compile_fill(Output *out, State *st, bool zero)
+{
+    int64_t count = read_const_expr(st).result;
+    int64_t size = 1;
+    int64_t value = 0;
+    if (!zero && is_punct(st, peek_token(st), ',')) {
+        read_token(st);
+        size = read_const_expr(st).result;
+        if (is_punct(st, peek_token(st), ',')) {
+            read_token(st);
+            value = read_const_expr(st).result;
+        }
+    }
+    if (count < 0 || count > INT64_MAX / 8) {
+        error(st, "Count out of range: %lld", (long long)count);
+        return;
+    }
+    if (size < 0 || size > 8) {
+        error(st, "Size out of range: %lld", (long long)size);
+        return;
+    }
+    emit_fill(out, st, count, size, (uint32_t)value);
+}
+
+// Emits the bytes of a file whose size is not known, such as those of
+// /proc, which say they are empty, by reading it.
+static void
+incbin_read(Output *out, State *st, int fd, int64_t offset, int64_t length,
+        const char *path)
+{
+    int64_t end = length < 0 || length > INT64_MAX - offset ? INT64_MAX
+        : offset + length;
+    int64_t pos = 0;
+    uint8_t buf[4096];
+    while (pos < end) {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            error(st, "Could not read file: %s", path);
+            return;
+        }
+        if (n == 0) {
+            break;
+        }
+        int64_t from = pos > offset ? pos : offset;
+        int64_t to = pos + n < end ? pos + n : end;
+        if (from < to) {
+            output_bytes(out, buf + (from - pos), to - from);
+        }
+        pos += n;
+    }
+    if (offset > pos) {
+        error(st, "Offset out of range: %lld", (long long)offset);
+    } else if (length >= 0 && end > pos) {
+        error(st, "Length out of range: %lld", (long long)length);
+    } else {
+        st->pc += (end < pos ? end : pos) - offset;
+        st->incbin = true;
+    }
+}
+
+// .incbin "file"[, offset[, length]] emits the bytes of the file from
+// offset, as many as length or up to its end.  They go to the output
+// without being read here, so the file must be a regular file, and is
+// only read if it has no size.
+static void
+compile_incbin(Output *out, State *st)
+{
+    if (st->no_incbin) {
+        error(st, ".incbin not allowed here");
+        return;
+    }
+    Str name;
+    if (!read_string(st, &name)) {
+        return;
+    }
+    int64_t offset = 0;
+    int64_t length = -1;
+    if (is_punct(st, peek_token(st), ',')) {
+        read_token(st);
+        offset = read_const_expr(st).result;
+        if (is_punct(st, peek_token(st), ',')) {
+            read_token(st);
+            length = read_const_expr(st).result;
+            if (length < 0) {
+                error(st, "Length out of range: %lld", (long long)length);
+                return;
+            }
+        }
+    }
+    char *path = strndup(name.data, name.len);
+    if (!path) {
+        out_of_memory();
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) != 0) {
+        error(st, "Could not open file: %s", path);
+    } else if (!S_ISREG(sb.st_mode)) {
+        error(st, "Not a regular file: %s", path);
+    } else if (offset < 0) {
+        error(st, "Offset out of range: %lld", (long long)offset);
+    } else if (sb.st_size == 0) {
+        incbin_read(out, st, fd, offset, length, path);
+    } else if (offset > sb.st_size) {
+        error(st, "Offset out of range: %lld", (long long)offset);
+    } else if (length > sb.st_size - offset) {
+        error(st, "Length out of range: %lld", (long long)length);
+    } else {
+        if (length < 0) {
+            length = sb.st_size - offset;
+        }
+        if (output_file(out, fd, offset, length)) {
+            st->pc += length;
+            st->incbin = true;
+        } else {
+            error(st, "Could not read file: %s", path);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(path);
+}
@@ -0,0 +1,59 @@
+// Encoding the values of many fixups of one kind at once.
+//
+// An immediate is a few fields of the value moved to other bits of the
+// instruction, the same for every fixup of a kind, so the fixups are
+// resolved a kind at a time: their values are gathered into an array, and
+// every field is shifted and masked into place 8 values at a time with
+// AVX2, or 4 with SSE2.  The scalar loop does the rest, and all of it
+// when there is no vector unit or RVAS_SCALAR_FIXUPS is defined.  Both
+// give the same result as fixup_bits.
+
+#if !defined(RVAS_SCALAR_FIXUPS) && defined(__AVX2__)
+#include <immintrin.h>
+#define FIXUP_VECTOR 8
+#elif !defined(RVAS_SCALAR_FIXUPS) && defined(__SSE2__)
+#include <emmintrin.h>
+#define FIXUP_VECTOR 4
+#endif
+
+// Replaces each of the values with the bits it sets in an instruction
+// with a fixup of the kind.
+static void
+fixup_bits_all(FixupKind kind, uint32_t *values, size_t n)
+{
+    size_t i = 0;
+#if FIXUP_VECTOR == 8
+    const struct FixupFormat *fmt = &fixup_formats[kind];
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+        __m256i patch = _mm256_setzero_si256();
+        for (int k = 0; k < fmt->n_fields; k++) {
+            const struct FixupField *f = &fmt->fields[k];
+            __m256i field = _mm256_srl_epi32(v, _mm_cvtsi32_si128(f->lo));
+            field = _mm256_and_si256(field,
+                    _mm256_set1_epi32((1u << (f->hi - f->lo + 1)) - 1));
+            field = _mm256_sll_epi32(field, _mm_cvtsi32_si128(f->pos));
+            patch = _mm256_or_si256(patch, field);
+        }
+        _mm256_storeu_si256((__m256i *)(values + i), patch);
+    }
+#elif FIXUP_VECTOR == 4
+    const struct FixupFormat *fmt = &fixup_formats[kind];
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+        __m128i patch = _mm_setzero_si128();
+        for (int k = 0; k < fmt->n_fields; k++) {
+            const struct FixupField *f = &fmt->fields[k];
+            __m128i field = _mm_srl_epi32(v, _mm_cvtsi32_si128(f->lo));
+            field = _mm_and_si128(field,
+                    _mm_set1_epi32((1u << (f->hi - f->lo + 1)) - 1));
+            field = _mm_sll_epi32(field, _mm_cvtsi32_si128(f->pos));
+            patch = _mm_or_si128(patch, field);
+        }
+        _mm_storeu_si128((__m128i *)(values + i), patch);
+    }
+#endif
+    for (; i < n; i++) {
+        values[i] = fixup_bits(kind, (int32_t)values[i]);
+    }
+}
@@ -69,377 +69,253 @@ instr_type_csri(Reg rd, Csr csr, int32_t imm)
 }
 
 
-static uint32_t
-instr_add(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b0110011;
-}
-
-static uint32_t
-instr_addi(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b0010011;
-}
-
-static uint32_t
-instr64_addiw(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b0011011;
-}
-
-static uint32_t
-instr64_addw(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b0111011;
-}
-
-static uint32_t
-instr_and(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b111000000110011;
-}
-
-static uint32_t
-instr_andi(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b111000000010011;
-}
-
-static uint32_t
-instr_auipc(Reg rd, int32_t imm)
-{
-    return instr_type_u(rd, imm) | 0b0010111;
-}
-
-static uint32_t
-instr_beq(Reg rs1, Reg rs2, int32_t imm)
-{
-    return instr_type_b(rs1, rs2, imm) | 0b1100011;
-}
-
-static uint32_t
-instr_bge(Reg rs1, Reg rs2, int32_t imm)
-{
-    return instr_type_b(rs1, rs2, imm) | 0b101000001100011;
-}
-
-static uint32_t
-instr_bgeu(Reg rs1, Reg rs2, int32_t imm)
-{
-    return instr_type_b(rs1, rs2, imm) | 0b111000001100011;
-}
-
-static uint32_t
-instr_blt(Reg rs1, Reg rs2, int32_t imm)
-{
-    return instr_type_b(rs1, rs2, imm) | 0b100000001100011;
-}
-
-static uint32_t
-instr_bltu(Reg rs1, Reg rs2, int32_t imm)
-{
-    return instr_type_b(rs1, rs2, imm) | 0b110000001100011;
-}
-
-static uint32_t
-instr_bne(Reg rs1, Reg rs2, int32_t imm)
-{
-    return instr_type_b(rs1, rs2, imm) | 0b1000001100011;
-}
+// The format decides both the operand syntax and how the operands are
+// packed around the fixed bits of the instruction.
+enum Format {
+    FMT_R,       // rd, rs1, rs2
+    FMT_I,       // rd, rs1, imm
+    FMT_SHIFT,   // rd, rs1, shamt (5 bits on RV32, 6 bits on RV64)
+    FMT_SHIFTW,  // rd, rs1, shamt (always 5 bits)
+    FMT_LOAD,    // rd, imm(rs1)
+    FMT_STORE,   // rs2, imm(rs1)
+    FMT_B,       // rs1, rs2, label
+    FMT_U,       // rd, imm
+    FMT_J,       // rd, label
+    FMT_CSR,     // rd, csr, rs1
+    FMT_CSRI,    // rd, csr, uimm
+    FMT_NONE,    // No operands.
+
+    // The c. mnemonics whose operands are not written as those of the
+    // instruction they stand for.
+    FMT_C_RR,    // rd, rs2, for rd, rd, rs2
+    FMT_C_MV,    // rd, rs2, for rd, x0, rs2
+    FMT_C_RI,    // rd, imm, for rd, rd, imm
+    FMT_C_LI,    // rd, imm, for rd, x0, imm
+    FMT_C_JR,    // rs1, for 0(rs1)
+    FMT_C_J,     // label
+    FMT_C_BZ,    // rs1, label, for rs1, x0, label
+
+    // Pseudo-instructions that expand to more than one instruction.
+    FMT_LI,      // rd, imm
+    FMT_LA,      // rd, symbol
+    FMT_CALL,    // [rd,] symbol
+    FMT_TAIL,    // symbol
+};
+typedef enum Format Format;
+
+#define RV32 (1 << TARGET_RV32)
+#define RV64 (1 << TARGET_RV64)
+#define RVAL (RV32 | RV64)
+
+#define ENC(opcode, funct3, funct7) \
+    ((opcode) | (funct3) << 12 | (uint32_t)(funct7) << 25)
+
+struct Instr {
+    const char *name;
+    Format format;
+    uint32_t match;   // Opcode, funct3 and funct7 bits.
+    uint8_t targets;  // Bit set of the targets that have the instruction.
+
+    // A c. mnemonic: the 16-bit form of the instruction that match and
+    // the operands make, which includes the registers the form implies.
+    bool compressed;
+    uint16_t form;  // The bits that tell the form from the others.
+};
+typedef struct Instr Instr;
+
+static const Instr instrs[] = {
+    {"add",    FMT_R,      ENC(0x33, 0, 0x00),  RVAL},
+    {"sub",    FMT_R,      ENC(0x33, 0, 0x20),  RVAL},
+    {"sll",    FMT_R,      ENC(0x33, 1, 0x00),  RVAL},
+    {"slt",    FMT_R,      ENC(0x33, 2, 0x00),  RVAL},
+    {"sltu",   FMT_R,      ENC(0x33, 3, 0x00),  RVAL},
+    {"xor",    FMT_R,      ENC(0x33, 4, 0x00),  RVAL},
+    {"srl",    FMT_R,      ENC(0x33, 5, 0x00),  RVAL},
+    {"sra",    FMT_R,      ENC(0x33, 5, 0x20),  RVAL},
+    {"or",     FMT_R,      ENC(0x33, 6, 0x00),  RVAL},
+    {"and",    FMT_R,      ENC(0x33, 7, 0x00),  RVAL},
+    {"addw",   FMT_R,      ENC(0x3b, 0, 0x00),  RV64},
+    {"subw",   FMT_R,      ENC(0x3b, 0, 0x20),  RV64},
+    {"sllw",   FMT_R,      ENC(0x3b, 1, 0x00),  RV64},
+    {"srlw",   FMT_R,      ENC(0x3b, 5, 0x00),  RV64},
+    {"sraw",   FMT_R,      ENC(0x3b, 5, 0x20),  RV64},
+
+    {"addi",   FMT_I,      ENC(0x13, 0, 0x00),  RVAL},
+    {"slti",   FMT_I,      ENC(0x13, 2, 0x00),  RVAL},
+    {"sltiu",  FMT_I,      ENC(0x13, 3, 0x00),  RVAL},
+    {"xori",   FMT_I,      ENC(0x13, 4, 0x00),  RVAL},
+    {"ori",    FMT_I,      ENC(0x13, 6, 0x00),  RVAL},
+    {"andi",   FMT_I,      ENC(0x13, 7, 0x00),  RVAL},
+    {"addiw",  FMT_I,      ENC(0x1b, 0, 0x00),  RV64},
+    {"slli",   FMT_SHIFT,  ENC(0x13, 1, 0x00),  RVAL},
+    {"srli",   FMT_SHIFT,  ENC(0x13, 5, 0x00),  RVAL},
+    {"srai",   FMT_SHIFT,  ENC(0x13, 5, 0x20),  RVAL},
+    {"slliw",  FMT_SHIFTW, ENC(0x1b, 1, 0x00),  RV64},
+    {"srliw",  FMT_SHIFTW, ENC(0x1b, 5, 0x00),  RV64},
+    {"sraiw",  FMT_SHIFTW, ENC(0x1b, 5, 0x20),  RV64},
+
+    {"lb",     FMT_LOAD,   ENC(0x03, 0, 0x00),  RVAL},
+    {"lh",     FMT_LOAD,   ENC(0x03, 1, 0x00),  RVAL},
+    {"lw",     FMT_LOAD,   ENC(0x03, 2, 0x00),  RVAL},
+    {"ld",     FMT_LOAD,   ENC(0x03, 3, 0x00),  RV64},
+    {"lbu",    FMT_LOAD,   ENC(0x03, 4, 0x00),  RVAL},
+    {"lhu",    FMT_LOAD,   ENC(0x03, 5, 0x00),  RVAL},
+    {"lwu",    FMT_LOAD,   ENC(0x03, 6, 0x00),  RVAL},
+    {"jalr",   FMT_LOAD,   ENC(0x67, 0, 0x00),  RVAL},
+    {"sb",     FMT_STORE,  ENC(0x23, 0, 0x00),  RVAL},
+    {"sh",     FMT_STORE,  ENC(0x23, 1, 0x00),  RVAL},
+    {"sw",     FMT_STORE,  ENC(0x23, 2, 0x00),  RVAL},
+    {"sd",     FMT_STORE,  ENC(0x23, 3, 0x00),  RV64},
+
+    {"beq",    FMT_B,      ENC(0x63, 0, 0x00),  RVAL},
+    {"bne",    FMT_B,      ENC(0x63, 1, 0x00),  RVAL},
+    {"blt",    FMT_B,      ENC(0x63, 4, 0x00),  RVAL},
+    {"bge",    FMT_B,      ENC(0x63, 5, 0x00),  RVAL},
+    {"bltu",   FMT_B,      ENC(0x63, 6, 0x00),  RVAL},
+    {"bgeu",   FMT_B,      ENC(0x63, 7, 0x00),  RVAL},
+
+    {"lui",    FMT_U,      ENC(0x37, 0, 0x00),  RVAL},
+    {"auipc",  FMT_U,      ENC(0x17, 0, 0x00),  RVAL},
+    {"jal",    FMT_J,      ENC(0x6f, 0, 0x00),  RVAL},
+
+    {"csrrw",  FMT_CSR,    ENC(0x73, 1, 0x00),  RVAL},
+    {"csrrs",  FMT_CSR,    ENC(0x73, 2, 0x00),  RVAL},
+    {"csrrc",  FMT_CSR,    ENC(0x73, 3, 0x00),  RVAL},
+    {"csrrwi", FMT_CSRI,   ENC(0x73, 5, 0x00),  RVAL},
+    {"csrrsi", FMT_CSRI,   ENC(0x73, 6, 0x00),  RVAL},
+    {"csrrci", FMT_CSRI,   ENC(0x73, 7, 0x00),  RVAL},
+
+    {"nop",    FMT_NONE,   ENC(0x13, 0, 0x00),  RVAL},
+    {"ecall",  FMT_NONE,   0x00000073,          RVAL},
+    {"ebreak", FMT_NONE,   0x00100073,          RVAL},
+    {"wfi",    FMT_NONE,   0x10500073,          RVAL},
+
+    {"li",     FMT_LI,     0,                   RVAL},
+    {"la",     FMT_LA,     0,                   RVAL},
+    {"call",   FMT_CALL,   0,                   RVAL},
+    {"tail",   FMT_TAIL,   0,                   RVAL},
+
+    {"c.add",      FMT_C_RR,   ENC(0x33, 0, 0x00),  RVAL, true, 0x9002},
+    {"c.sub",      FMT_C_RR,   ENC(0x33, 0, 0x20),  RVAL, true, 0x8001},
+    {"c.xor",      FMT_C_RR,   ENC(0x33, 4, 0x00),  RVAL, true, 0x8001},
+    {"c.or",       FMT_C_RR,   ENC(0x33, 6, 0x00),  RVAL, true, 0x8001},
+    {"c.and",      FMT_C_RR,   ENC(0x33, 7, 0x00),  RVAL, true, 0x8001},
+    {"c.addw",     FMT_C_RR,   ENC(0x3b, 0, 0x00),  RV64, true, 0x8001},
+    {"c.subw",     FMT_C_RR,   ENC(0x3b, 0, 0x20),  RV64, true, 0x8001},
+    {"c.mv",       FMT_C_MV,   ENC(0x33, 0, 0x00),  RVAL, true, 0x8002},
+    {"c.addi",     FMT_C_RI,   ENC(0x13, 0, 0x00),  RVAL, true, 0x0001},
+    {"c.addiw",    FMT_C_RI,   ENC(0x1b, 0, 0x00),  RV64, true, 0x2001},
+    {"c.addi16sp", FMT_C_RI,   ENC(0x13, 0, 0x00),  RVAL, true, 0x6001},
+    {"c.andi",     FMT_C_RI,   ENC(0x13, 7, 0x00),  RVAL, true, 0x8001},
+    {"c.slli",     FMT_C_RI,   ENC(0x13, 1, 0x00),  RVAL, true, 0x0002},
+    {"c.srli",     FMT_C_RI,   ENC(0x13, 5, 0x00),  RVAL, true, 0x8001},
+    {"c.srai",     FMT_C_RI,   ENC(0x13, 5, 0x20),  RVAL, true, 0x8001},
+    {"c.li",       FMT_C_LI,   ENC(0x13, 0, 0x00),  RVAL, true, 0x4001},
+    {"c.lui",      FMT_U,      ENC(0x37, 0, 0x00),  RVAL, true, 0x6001},
+    {"c.addi4spn", FMT_I,      ENC(0x13, 0, 0x00),  RVAL, true, 0x0000},
+    {"c.lw",       FMT_LOAD,   ENC(0x03, 2, 0x00),  RVAL, true, 0x4000},
+    {"c.ld",       FMT_LOAD,   ENC(0x03, 3, 0x00),  RV64, true, 0x6000},
+    {"c.sw",       FMT_STORE,  ENC(0x23, 2, 0x00),  RVAL, true, 0xc000},
+    {"c.sd",       FMT_STORE,  ENC(0x23, 3, 0x00),  RV64, true, 0xe000},
+    {"c.lwsp",     FMT_LOAD,   ENC(0x03, 2, 0x00),  RVAL, true, 0x4002},
+    {"c.ldsp",     FMT_LOAD,   ENC(0x03, 3, 0x00),  RV64, true, 0x6002},
+    {"c.swsp",     FMT_STORE,  ENC(0x23, 2, 0x00),  RVAL, true, 0xc002},
+    {"c.sdsp",     FMT_STORE,  ENC(0x23, 3, 0x00),  RV64, true, 0xe002},
+    // The match of c.jal and c.jalr has ra in rd.
+    {"c.j",        FMT_C_J,    ENC(0x6f, 0, 0x00),  RVAL, true, 0xa001},
+    {"c.jal",      FMT_C_J,    ENC(0xef, 0, 0x00),  RV32, true, 0x2001},
+    {"c.jr",       FMT_C_JR,   ENC(0x67, 0, 0x00),  RVAL, true, 0x8002},
+    {"c.jalr",     FMT_C_JR,   ENC(0xe7, 0, 0x00),  RVAL, true, 0x9002},
+    {"c.beqz",     FMT_C_BZ,   ENC(0x63, 0, 0x00),  RVAL, true, 0xc001},
+    {"c.bnez",     FMT_C_BZ,   ENC(0x63, 1, 0x00),  RVAL, true, 0xe001},
+    {"c.nop",      FMT_NONE,   ENC(0x13, 0, 0x00),  RVAL, true, 0x0001},
+    {"c.ebreak",   FMT_NONE,   0x00100073,          RVAL, true, 0x9002},
+};
 
-static uint32_t
-instr_csrrc(Reg rd, Csr csr, Reg rs1)
-{
-    return instr_type_csr(rd, csr, rs1) | 0b11000001110011;
-}
-
-static uint32_t
-instr_csrrci(Reg rd, Csr csr, int32_t imm)
-{
-    return instr_type_csri(rd, csr, imm) | 0b111000001110011;
-}
-
-static uint32_t
-instr_csrrs(Reg rd, Csr csr, Reg rs1)
-{
-    return instr_type_csr(rd, csr, rs1) | 0b10000001110011;
-}
-
-static uint32_t
-instr_csrrsi(Reg rd, Csr csr, int32_t imm)
-{
-    return instr_type_csri(rd, csr, imm) | 0b110000001110011;
-}
+#undef ENC
 
-static uint32_t
-instr_csrrw(Reg rd, Csr csr, Reg rs1)
-{
-    return instr_type_csr(rd, csr, rs1) | 0b100001110011;
-}
-
-static uint32_t
-instr_csrrwi(Reg rd, Csr csr, int32_t imm)
-{
-    return instr_type_csri(rd, csr, imm) | 0b101000001110011;
-}
-
-static uint32_t
-instr_ebreak()
-{
-    return 0b100000000000001110011;
-}
+static PerfectHash isa_hash;
 
-static uint32_t
-instr_ecall()
-{
-    return 0b1110011;
-}
-
-static uint32_t
-instr_jal(Reg rd, int32_t imm)
-{
-    return instr_type_j(rd, imm) | 0b1101111;
-}
-
-static uint32_t
-instr_jalr(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b1100111;
-}
-
-static uint32_t
-instr_lb(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b11;
-}
-
-static uint32_t
-instr_lbu(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b100000000000011;
-}
-
-static uint32_t
-instr_ld(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b011000000000011;
-}
-
-static uint32_t
-instr_lh(Reg rd, Reg rs1, int32_t imm)
+static void
+isa_init(void)
 {
-    return instr_type_i(rd, rs1, imm) | 0b001000000000011;
+    Str names[ARR_SIZE(instrs)];
+    for (size_t i = 0; i < ARR_SIZE(instrs); i++) {
+        names[i] = str(instrs[i].name);
+    }
+    phash_build(&isa_hash, names, ARR_SIZE(instrs));
 }
 
-static uint32_t
-instr_lhu(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b101000000000011;
-}
-
-static uint32_t
-instr_lui(Reg rd, int32_t imm)
-{
-    return instr_type_u(rd, imm) | 0b0110111;
-}
-
-static uint32_t
-instr_lw(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b10000000000011;
-}
-
-static uint32_t
-instr_lwu(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b110000000000011;
-}
-
-static uint32_t
-instr_or(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b110000000110011;
-}
-
-static uint32_t
-instr_ori(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b110000000010011;
-}
-
-static uint32_t
-instr_sb(Reg rs2, Reg rs1, int32_t imm)
-{
-    return instr_type_s(rs1, rs2, imm) | 0b0100011;
-}
-
-static uint32_t
-instr_sd(Reg rs2, Reg rs1, int32_t imm)
-{
-    return instr_type_s(rs1, rs2, imm) | 0b011000000100011;
-}
-
-static uint32_t
-instr_sh(Reg rs2, Reg rs1, int32_t imm)
-{
-    return instr_type_s(rs1, rs2, imm) | 0b001000000100011;
-}
-
-static uint32_t
-instr_sll(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b001000000110011;
-}
-
-static uint32_t
-instr32_slli(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 4, 0);
-    return instr_type_i(rd, rs1, imm) | 0b001000000010011;
-}
-
-static uint32_t
-instr64_slli(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 5, 0);
-    return instr_type_i(rd, rs1, imm) | 0b001000000010011;
-}
-
-static uint32_t
-instr64_slliw(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 5, 0);  // TODO: Bit 5 must be 0, how to implement that?
-    return instr_type_i(rd, rs1, imm) | 0b001000000011011;
-}
-
-static uint32_t
-instr64_sllw(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b001000000111011;
-}
-
-static uint32_t
-instr_slt(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b010000000110011;
-}
-
-static uint32_t
-instr_slti(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b010000000010011;
-}
-
-static uint32_t
-instr_sltiu(Reg rd, Reg rs1, int32_t imm)
-{
-    return instr_type_i(rd, rs1, imm) | 0b011000000010011;
-}
-
-static uint32_t
-instr_sltu(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b011000000110011;
-}
-
-static uint32_t
-instr_sra(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 1 << 30 | 0b101000000110011;
-}
-
-static uint32_t
-instr32_srai(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 4, 0);
-    return instr_type_i(rd, rs1, imm) | 1 << 30 | 0b10100000010011;
-}
-
-static uint32_t
-instr64_srai(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 5, 0);
-    return instr_type_i(rd, rs1, imm) | 1 << 30 | 0b10100000010011;
-}
-
-static uint32_t
-instr64_sraiw(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 5, 0);
-    return instr_type_i(rd, rs1, imm) | 1 << 30 | 0b10100000011011;
-}
-
-static uint32_t
-instr64_sraw(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 1 << 30 | 0b101000000111011;
-}
-
-static uint32_t
-instr_srl(Reg rd, Reg rs1, Reg rs2)
-{
-    return instr_type_r(rd, rs1, rs2) | 0b101000000110011;
-}
-
-static uint32_t
-instr32_srli(Reg rd, Reg rs1, int32_t imm)
-{
-    imm = bits(imm, 4, 0);
-    return instr_type_i(rd, rs1, imm) | 0b101000000010011;
-}
-
-static uint32_t
-instr64_srli(Reg rd, Reg rs1, int32_t imm)
+static const Instr *
+isa_lookup(Str name, uint64_t hash, Target target)
 {
-    imm = bits(imm, 5, 0);
-    return instr_type_i(rd, rs1, imm) | 0b101000000010011;
+    ptrdiff_t i = phash_find(&isa_hash, hash);
+    if (i < 0) {
+        return NULL;
+    }
+    const Instr *in = &instrs[i];
+    if (!(in->targets & 1 << (target & TARGET_RV64))
+            || !str_eq(str(in->name), name))
+    {
+        return NULL;
+    }
+    return in;
 }
 
 static uint32_t
-instr64_srliw(Reg rd, Reg rs1, int32_t imm)
+instr_encode_r(const Instr *in, Reg rd, Reg rs1, Reg rs2)
 {
-    imm = bits(imm, 5, 0);
-    return instr_type_i(rd, rs1, imm) | 0b101000000011011;
+    return instr_type_r(rd, rs1, rs2) | in->match;
 }
 
 static uint32_t
-instr64_srlw(Reg rd, Reg rs1, Reg rs2)
+instr_encode_i(const Instr *in, Target target, Reg rd, Reg rs1, int32_t imm)
 {
-    return instr_type_r(rd, rs1, rs2) | 0b101000000111011;
+    switch (in->format) {
+    case FMT_SHIFT:
+        imm = target & TARGET_RV64 ? bits(imm, 5, 0) : bits(imm, 4, 0);
+        break;
+    case FMT_SHIFTW:
+        imm = bits(imm, 4, 0);
+        break;
+    default:
+        break;
+    }
+    return instr_type_i(rd, rs1, imm) | in->match;
 }
 
 static uint32_t
-instr_sub(Reg rd, Reg rs1, Reg rs2)
+instr_encode_s(const Instr *in, Reg rs2, Reg rs1, int32_t imm)
 {
-    return instr_type_r(rd, rs1, rs2) | 1 << 30 | 0b00000000110011;
+    return instr_type_s(rs1, rs2, imm) | in->match;
 }
 
 static uint32_t
-instr64_subw(Reg rd, Reg rs1, Reg rs2)
+instr_encode_b(const Instr *in, Reg rs1, Reg rs2, int32_t imm)
 {
-    return instr_type_r(rd, rs1, rs2) | 1 << 30 | 0b00000000111011;
+    return instr_type_b(rs1, rs2, imm) | in->match;
 }
 
 static uint32_t
-instr_sw(Reg rs2, Reg rs1, int32_t imm)
+instr_encode_u(const Instr *in, Reg rd, int32_t imm)
 {
-    return instr_type_s(rs1, rs2, imm) | 0b10000000100011;
+    return instr_type_u(rd, imm) | in->match;
 }
 
 static uint32_t
-instr_wfi()
+instr_encode_j(const Instr *in, Reg rd, int32_t imm)
 {
-    return 0b10000010100000000000001110011;
+    return instr_type_j(rd, imm) | in->match;
 }
 
 static uint32_t
-instr_xor(Reg rd, Reg rs1, Reg rs2)
+instr_encode_csr(const Instr *in, Reg rd, Csr csr, Reg rs1)
 {
-    return instr_type_r(rd, rs1, rs2) | 0b100000000110011;
+    return instr_type_csr(rd, csr, rs1) | in->match;
 }
 
 static uint32_t
-instr_xori(Reg rd, Reg rs1, int32_t imm)
+instr_encode_csri(const Instr *in, Reg rd, Csr csr, int32_t imm)
 {
-    return instr_type_i(rd, rs1, imm) | 0b100000000010011;
+    return instr_type_csri(rd, csr, imm) | in->match;
 }
@@ -0,0 +1,214 @@
+// The library interface, see rvas.h.
+
+#include <pthread.h>
+
+#include "rvas.h"
+
+struct Rvas {
+    State st;
+    Output out;
+    Target target;
+    bool incbin;  // .incbin is allowed.
+
+    // The output, if it does not fit in one chunk.
+    uint8_t *image;
+    size_t cap_image;
+
+    RvasDiag *diags;
+    size_t n_diags;
+    size_t cap_diags;
+    bool out_of_memory;
+};
+
+static const RvasDiag rvas_oom = {0, "Out of memory"};
+
+static pthread_once_t rvas_once = PTHREAD_ONCE_INIT;
+
+static void
+rvas_init(void)
+{
+    isa_init();
+    names_init();
+}
+
+Rvas *
+rvas_new(void)
+{
+    pthread_once(&rvas_once, rvas_init);
+    Rvas *ctx = calloc(1, sizeof *ctx);
+    if (ctx) {
+        ctx->target = TARGET_RV64;
+    }
+    return ctx;
+}
+
+// Removes all symbols, keeping the memory for the next ones.
+static void
+symtab_clear(Symtab *tab)
+{
+    if (tab->n_syms < tab->n_slots / 16) {
+        // After a big source, clearing only the slots in use keeps a
+        // small one fast.
+        size_t mask = tab->n_slots - 1;
+        for (size_t id = 0; id < tab->n_syms; id++) {
+            size_t i = tab->syms[id].hash & mask;
+            while (tab->slots[i].id != id + 1) {
+                i = (i + 1) & mask;
+            }
+            tab->slots[i].id = 0;
+        }
+    } else if (tab->slots) {
+        memset(tab->slots, 0, tab->n_slots * sizeof *tab->slots);
+    }
+    tab->n_syms = 0;
+}
+
+// Empties the output, keeping its biggest chunk for the next one.
+static void
+output_clear(Output *out)
+{
+    if (!out->n_chunks) {
+        return;
+    }
+    Chunk last = out->chunks[out->n_chunks - 1];
+    for (size_t i = 0; i + 1 < out->n_chunks; i++) {
+        output_free_chunk(out, &out->chunks[i]);
+    }
+    if (last.file) {
+        output_free_chunk(out, &last);
+        last = (Chunk){0};
+    }
+    out->chunks[0] = (Chunk){.data = last.data, .cap = last.cap};
+    out->n_chunks = last.data ? 1 : 0;
+    out->output_len = 0;
+}
+
+// Frees the errors of the last call.
+static void
+rvas_clear_diags(Rvas *ctx)
+{
+    for (size_t i = 0; i < ctx->st.n_errors; i++) {
+        free(ctx->st.diags[i].msg);
+    }
+    ctx->st.n_errors = 0;
+    ctx->n_diags = 0;
+    ctx->out_of_memory = false;
+}
+
+void
+rvas_free(Rvas *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+    rvas_clear_diags(ctx);
+    free(ctx->st.diags);
+    state_free(&ctx->st);
+    output_free(&ctx->out);
+    free(ctx->image);
+    free(ctx->diags);
+    free(ctx);
+}
+
+void
+rvas_set_target(Rvas *ctx, enum RvasTarget target)
+{
+    switch (target) {
+    case RVAS_RV32:
+        ctx->target = TARGET_RV32;
+        break;
+    case RVAS_RV32C:
+        ctx->target = TARGET_RV32 | TARGET_C;
+        break;
+    case RVAS_RV64C:
+        ctx->target = TARGET_RV64 | TARGET_C;
+        break;
+    default:
+        ctx->target = TARGET_RV64;
+        break;
+    }
+}
+
+void
+rvas_allow_incbin(Rvas *ctx, int allow)
+{
+    ctx->incbin = allow;
+}
+
+// Empties the context for the next source, keeping its memory.
+static void
+rvas_reset(Rvas *ctx, Str code)
+{
+    State *st = &ctx->st;
+    rvas_clear_diags(ctx);
+    symtab_clear(&st->symtab);
+    *st = (State) {
+        .code = code,
+        .scanner = scanner(code),
+        .toks = st->toks,
+        .cap_toks = st->cap_toks,
+        .symtab = st->symtab,
+        .fixups = st->fixups,
+        .cap_fixups = st->cap_fixups,
+        .aligns = st->aligns,
+        .cap_aligns = st->cap_aligns,
+        .diags = st->diags,
+        .cap_diags = st->cap_diags,
+        .no_incbin = !ctx->incbin,
+    };
+    output_clear(&ctx->out);
+}
+
+int
+rvas_assemble(Rvas *ctx, const char *src, size_t len, RvasOutput *out)
+{
+    rvas_reset(ctx, (Str){src, len});
+    *out = (RvasOutput){0};
+
+    jmp_buf jump;
+    if (setjmp(jump)) {
+        oom_jump = NULL;
+        ctx->out_of_memory = true;
+        return -1;
+    }
+    oom_jump = &jump;
+
+    State *st = &ctx->st;
+    assemble(st, &ctx->out, ctx->target);
+    Relax relax;
+    relax_and_resolve(st, &ctx->out, ctx->target, &relax);
+    relax_free(&relax);
+    sort_diags(st);
+    ctx->diags = grow(ctx->diags, &ctx->cap_diags, st->n_errors,
+            sizeof *ctx->diags);
+    for (size_t i = 0; i < st->n_errors; i++) {
+        ctx->diags[i] = (RvasDiag){st->diags[i].line, st->diags[i].msg};
+    }
+    ctx->n_diags = st->n_errors;
+    if (st->n_errors) {
+        oom_jump = NULL;
+        return -1;
+    }
+
+    Output *o = &ctx->out;
+    if (o->n_chunks == 1) {
+        *out = (RvasOutput){o->chunks[0].data, o->output_len};
+    } else if (o->n_chunks > 1) {
+        ctx->image = grow(ctx->image, &ctx->cap_image, o->output_len, 1);
+        output_copy(o, ctx->image);
+        *out = (RvasOutput){ctx->image, o->output_len};
+    }
+    oom_jump = NULL;
+    return 0;
+}
+
+const RvasDiag *
+rvas_diags(const Rvas *ctx, size_t *n)
+{
+    if (ctx->out_of_memory) {
+        *n = 1;
+        return &rvas_oom;
+    }
+    *n = ctx->n_diags;
+    return ctx->diags;
+}
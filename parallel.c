@@ -0,0 +1,294 @@
+// Assembling several files, or a big file, on several threads.
+//
+// Every file is cut into chunks at line boundaries, a big file into
+// several and a small one into one, and every chunk is assembled on its
+// own into a fragment: its output, its labels and its fixups, as if it
+// started at pc 0 and line 0.  The fragments are then laid out in order:
+// the pcs, lines and fixups of a chunk are shifted by what came before
+// it, its labels are added to the symbol table of the whole input, and
+// its output is appended without copying.  The fixups are resolved once
+// at the end, across all files, so the output is the same as for the
+// files one after the other in a single file.
+//
+// A chunk does not know where it starts either, so its alignments are
+// padded as if it started at 0, and padded again when the fixups are
+// resolved if that was wrong.
+//
+// Constants are the one thing a chunk cannot work out on its own, because
+// a .equ in an earlier chunk changes how a later chunk must encode an
+// instruction.  They are rare, so the lines with an "equ" in them are
+// assembled once up front, and the chunks look the constants up there.
+//
+// A label that is defined again in a later chunk is only found when the
+// chunks are merged, so the rest of its line has been assembled.  This
+// can only add "Undefined symbol" errors to a code that has errors anyway.
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Chunks smaller than this are not worth a thread.
+#ifndef PARALLEL_MIN_CHUNK
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+#endif
+
+// A chunk to assemble.
+struct Worker {
+    State st;
+    Output out;
+};
+typedef struct Worker Worker;
+
+struct Pool {
+    Worker *workers;
+    size_t n_workers;
+    atomic_size_t next;  // The next chunk to assemble.
+    Target target;
+};
+typedef struct Pool Pool;
+
+// Adds the constants of a file to tab.  Everything else that is defined
+// on the same lines, and every error, is thrown away: the chunks find
+// them again.
+static void
+prescan_consts(Symtab *tab, const Source *source, uint32_t file,
+        uint64_t pos_base, Target target)
+{
+    Str code = source->code;
+    State st = {
+        .code = code,
+        .file = file,
+        .pos_base = pos_base,
+        .scanner = scanner(code),
+        .symtab = *tab,
+    };
+    Output out = {0};
+    size_t pos = 0;
+    while (pos < code.len) {
+        const char *hit = memmem(code.data + pos, code.len - pos, "equ", 3);
+        if (!hit) {
+            break;
+        }
+        size_t start = hit - code.data;
+        while (start > pos && code.data[start - 1] != '\n') {
+            start--;
+        }
+        for (const char *p = code.data + pos;
+                (p = memchr(p, '\n', code.data + start - p)); p++)
+        {
+            st.line++;
+        }
+        st.i = start;
+        lex_line(&st);
+        compile_line(&out, &st, target);
+        pos = st.i;
+    }
+    output_free(&out);
+
+    // Keep only the constants.
+    Symtab consts = {0};
+    for (size_t i = 0; i < st.symtab.n_syms; i++) {
+        const Symbol *sym = &st.symtab.syms[i];
+        if (sym->kind == SYM_CONST) {
+            SymId id = sym_intern(&consts, sym->name, sym->hash);
+            consts.syms[id] = *sym;
+        }
+    }
+    *tab = consts;
+    state_free(&st);
+    for (size_t i = 0; i < st.n_errors; i++) {
+        free(st.diags[i].msg);
+    }
+    free(st.diags);
+}
+
+static void *
+pool_run(void *arg)
+{
+    Pool *pool = arg;
+    for (;;) {
+        size_t k = atomic_fetch_add(&pool->next, 1);
+        if (k >= pool->n_workers) {
+            return NULL;
+        }
+        Worker *w = &pool->workers[k];
+        assemble(&w->st, &w->out, pool->target);
+    }
+}
+
+// Appends the fragment of a chunk to st and out.
+static void
+merge_chunk(State *st, Output *out, Worker *w, size_t base_line)
+{
+    uint64_t base = out->output_len;
+    Symtab *local = &w->st.symtab;
+    SymId *ids = malloc(local->n_syms * sizeof *ids + 1);
+    if (!ids) {
+        out_of_memory();
+    }
+    for (size_t i = 0; i < local->n_syms; i++) {
+        const Symbol *sym = &local->syms[i];
+        ids[i] = sym_intern(&st->symtab, sym->name, sym->hash);
+        if (sym->kind != SYM_LABEL) {
+            continue;
+        }
+        Symbol *global = &st->symtab.syms[ids[i]];
+        if (global->kind == SYM_LABEL) {
+            error_at(st, sym->file, sym->line + base_line,
+                    "Symbol redefined: %.*s",
+                    (int)sym->name.len, sym->name.data);
+            continue;
+        }
+        if (global->kind == SYM_CONST) {
+            // The chunk has checked the constants before the label, so
+            // this one comes after it, in a later chunk.  As in a
+            // sequential assembly, the label wins.
+            error_at(st, global->file, global->line,
+                    "Symbol redefined: %.*s",
+                    (int)sym->name.len, sym->name.data);
+        }
+        *global = *sym;
+        global->value += base;
+        global->line += base_line;
+    }
+
+    st->fixups = grow(st->fixups, &st->cap_fixups,
+            st->n_fixups + w->st.n_fixups, sizeof *st->fixups);
+    for (size_t i = 0; i < w->st.n_fixups; i++) {
+        Fixup f = w->st.fixups[i];
+        f.offset += base;
+        f.sym = ids[f.sym];
+        st->fixups[st->n_fixups++] = f;
+    }
+    free(ids);
+
+    st->aligns = grow(st->aligns, &st->cap_aligns,
+            st->n_aligns + w->st.n_aligns, sizeof *st->aligns);
+    for (size_t i = 0; i < w->st.n_aligns; i++) {
+        Align a = w->st.aligns[i];
+        a.offset += base;
+        st->aligns[st->n_aligns++] = a;
+    }
+
+    st->diags = grow(st->diags, &st->cap_diags,
+            st->n_errors + w->st.n_errors, sizeof *st->diags);
+    for (size_t i = 0; i < w->st.n_errors; i++) {
+        Diag d = w->st.diags[i];
+        d.line += base_line;
+        st->diags[st->n_errors++] = d;
+    }
+    free(w->st.diags);
+
+    out->chunks = grow(out->chunks, &out->cap_chunks,
+            out->n_chunks + w->out.n_chunks, sizeof *out->chunks);
+    for (size_t i = 0; i < w->out.n_chunks; i++) {
+        Chunk c = w->out.chunks[i];
+        c.start += base;
+        out->chunks[out->n_chunks++] = c;
+    }
+    out->output_len += w->out.output_len;
+    free(w->out.chunks);
+    st->incbin |= w->st.incbin;
+}
+
+// Assembles the files on up to n_threads threads, leaving the results in
+// st and out as a sequential assembly of the files one after the other
+// would, except that the fixups are not resolved.  Returns false without
+// doing anything if there is a single file that is too small to be split.
+static bool
+compile_parallel(State *st, Output *out, const Source *sources,
+        size_t n_sources, Target target, int n_threads)
+{
+    if (n_sources == 1 && (n_threads < 2
+            || sources[0].code.len < 2 * PARALLEL_MIN_CHUNK))
+    {
+        return false;
+    }
+
+    Symtab consts = {0};
+    uint64_t pos_base = 0;
+    for (size_t f = 0; f < n_sources; f++) {
+        prescan_consts(&consts, &sources[f], f, pos_base, target);
+        pos_base += sources[f].code.len;
+    }
+
+    Pool pool = {.target = target};
+    size_t cap_workers = 0;
+    pos_base = 0;
+    for (size_t f = 0; f < n_sources; f++) {
+        Str code = sources[f].code;
+        size_t n_chunks = code.len / PARALLEL_MIN_CHUNK;
+        if (n_threads < (int)n_chunks) {
+            n_chunks = n_threads;
+        }
+        if (n_chunks < 1) {
+            n_chunks = 1;
+        }
+        size_t start = 0;
+        for (size_t k = 0; k < n_chunks && start < code.len; k++) {
+            size_t end = code.len;
+            if (k + 1 < n_chunks) {
+                end = (k + 1) * (code.len / n_chunks);
+                if (end < start) {
+                    end = start;
+                }
+                const char *nl = memchr(code.data + end, '\n',
+                        code.len - end);
+                end = nl ? (size_t)(nl - code.data) + 1 : code.len;
+            }
+            Str part = {code.data, end};
+            pool.workers = grow(pool.workers, &cap_workers,
+                    pool.n_workers + 1, sizeof *pool.workers);
+            pool.workers[pool.n_workers++] = (Worker) {
+                .st = {
+                    .code = part,
+                    .i = start,
+                    .file = f,
+                    .pos_base = pos_base,
+                    .scanner = scanner(part),
+                    .consts = &consts,
+                },
+            };
+            start = end;
+        }
+        pos_base += code.len;
+    }
+
+    // This thread is one of the n_threads.
+    size_t n_spawned = pool.n_workers < (size_t)n_threads
+        ? pool.n_workers : (size_t)n_threads;
+    n_spawned = n_spawned ? n_spawned - 1 : 0;
+    pthread_t *threads = malloc(n_spawned * sizeof *threads + 1);
+    if (!threads) {
+        out_of_memory();
+    }
+    for (size_t t = 0; t < n_spawned; t++) {
+        if (pthread_create(&threads[t], NULL, pool_run, &pool)) {
+            print_error("Could not start thread.\n");
+            abort();
+        }
+    }
+    pool_run(&pool);
+    for (size_t t = 0; t < n_spawned; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    // The chunks are done with the constants, so they can become the
+    // symbol table of the whole input.
+    *st = (State) {
+        .symtab = consts,
+    };
+    size_t base_line = 0;
+    for (size_t k = 0; k < pool.n_workers; k++) {
+        Worker *w = &pool.workers[k];
+        if (k && w->st.file != pool.workers[k - 1].st.file) {
+            base_line = 0;
+        }
+        merge_chunk(st, out, w, base_line);
+        base_line += w->st.line;
+        st->line += w->st.line;
+        state_free(&w->st);
+    }
+    free(pool.workers);
+    return true;
+}
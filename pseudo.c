@@ -0,0 +1,181 @@
+// Pseudo-instructions that expand to more than one instruction.
+
+// The instructions the expansions are made of, without their operands.
+#define PSEUDO_LUI   0x00000037
+#define PSEUDO_AUIPC 0x00000017
+#define PSEUDO_ADDI  0x00000013
+#define PSEUDO_ADDIW 0x0000001b
+#define PSEUDO_SLLI  0x00001013
+#define PSEUDO_SRLI  0x00005013
+#define PSEUDO_JALR  0x00000067
+#define PSEUDO_JAL   0x0000006f
+
+// One instruction of the sequence that li expands to.  Each one but the
+// first takes the register that the one before it set.
+struct LiStep {
+    uint32_t match;
+    int64_t imm;
+};
+typedef struct LiStep LiStep;
+
+// The longest sequence li needs on RV64.
+#define LI_MAX_STEPS 8
+
+static int64_t
+sext12(int64_t n)
+{
+    return (int64_t)((uint64_t)n << 52) >> 52;
+}
+
+// Fills seq with a sequence that sets a register to value, and returns its
+// length.  A value of 32 bits is lui and addi; a longer one is built from
+// its upper bits, then shifted and added to 12 bits at a time.
+static int
+li_build(int64_t value, Target target, LiStep *seq)
+{
+    if (!(target & TARGET_RV64) || value == (int32_t)value) {
+        int64_t hi20 = ((value + 0x800) >> 12) & 0xFFFFF;
+        int64_t lo12 = sext12(value);
+        int n = 0;
+        if (hi20) {
+            seq[n++] = (LiStep){PSEUDO_LUI, hi20};
+        }
+        if (lo12 || !hi20) {
+            // On RV64, lui sign-extends, so the addition must wrap at 32
+            // bits as addiw does.
+            uint32_t add = target & TARGET_RV64 && hi20
+                ? PSEUDO_ADDIW : PSEUDO_ADDI;
+            seq[n++] = (LiStep){add, lo12};
+        }
+        return n;
+    }
+
+    int64_t lo12 = sext12(value);
+    value = (uint64_t)value - (uint64_t)lo12;
+    int shift = __builtin_ctzll(value);
+    value >>= shift;
+    // Keep 12 bits of zeros if that makes the rest fit lui.
+    int64_t up = (uint64_t)value << 12;
+    if (shift > 12 && sext12(value) != value && up == (int32_t)up) {
+        shift -= 12;
+        value = up;
+    }
+    int n = li_build(value, target, seq);
+    seq[n++] = (LiStep){PSEUDO_SLLI, shift};
+    if (lo12) {
+        seq[n++] = (LiStep){PSEUDO_ADDI, lo12};
+    }
+    return n;
+}
+
+// Like li_build, but also tries to build a value with trailing zeros
+// shifted right, or one with leading zeros shifted left, and shifts it
+// back at the end.  Returns the shortest sequence.
+static int
+li_steps(int64_t value, Target target, LiStep *seq)
+{
+    if (!(target & TARGET_RV64)) {
+        value = (int32_t)value;
+    }
+    int n = li_build(value, target, seq);
+    LiStep tmp[LI_MAX_STEPS + 1];
+    if (n > 2 && (value & 0xFFF) && !(value & 1)) {
+        int shift = __builtin_ctzll(value);
+        int k = li_build(value >> shift, target, tmp);
+        if (k + 1 < n) {
+            tmp[k++] = (LiStep){PSEUDO_SLLI, shift};
+            memcpy(seq, tmp, k * sizeof *tmp);
+            n = k;
+        }
+    }
+    if (n > 2 && value > 0) {
+        int shift = __builtin_clzll(value);
+        uint64_t ones = (UINT64_C(1) << shift) - 1;
+        // The bits shifted in may as well be ones as zeros, whichever is
+        // shorter.
+        uint64_t shifted[] = {
+            (uint64_t)value << shift | ones,
+            (uint64_t)value << shift,
+        };
+        for (int i = 0; i < 2; i++) {
+            int k = li_build(shifted[i], target, tmp);
+            if (k + 1 < n) {
+                tmp[k++] = (LiStep){PSEUDO_SRLI, shift};
+                memcpy(seq, tmp, k * sizeof *tmp);
+                n = k;
+            }
+        }
+    }
+    return n;
+}
+
+static void
+compile_li(Output *out, State *st, Target target)
+{
+    Reg rd = read_reg(st);
+    expect(st, ',');
+    Expr e = read_const_expr(st);
+    LiStep seq[LI_MAX_STEPS];
+    int n = li_steps(e.result, target, seq);
+    for (int i = 0; i < n; i++) {
+        uint32_t instr = seq[i].match == PSEUDO_LUI
+            ? instr_type_u(rd, seq[i].imm << 12)
+            : instr_type_i(rd, i ? rd : REG_ZERO, seq[i].imm);
+        emit_instr(out, st,
+                compress((CompiledInstr){.instr = instr | seq[i].match},
+                    target));
+    }
+}
+
+// Emits auipc rs, %pcrel_hi(sym), and then the instruction match with rd,
+// rs and %pcrel_lo of the auipc, which is la, call or tail.
+static void
+compile_pcrel_pair(Output *out, State *st, uint32_t match, Reg rd, Reg rs,
+        Expr e)
+{
+    emit_instr(out, st, (CompiledInstr) {
+        .instr = instr_type_u(rs, 0) | PSEUDO_AUIPC,
+        .replace_imm = !e.known,
+        .fixup = {.kind = FIXUP_PCREL_HI, .sym = e.known ? 0 : e.sym},
+    });
+    emit_instr(out, st, (CompiledInstr) {
+        .instr = instr_type_i(rd, rs, 0) | match,
+        .replace_imm = !e.known,
+        .fixup = {.kind = FIXUP_PAIR_LO, .sym = e.known ? 0 : e.sym},
+    });
+}
+
+static void
+compile_pseudo(Output *out, State *st, const Instr *in, Target target)
+{
+    switch (in->format) {
+    case FMT_LI:
+        compile_li(out, st, target);
+        break;
+    case FMT_LA: {
+        Reg rd = read_reg(st);
+        expect(st, ',');
+        compile_pcrel_pair(out, st, PSEUDO_ADDI, rd, rd,
+                read_symbol_expr(st));
+        break;
+    }
+    case FMT_CALL: {
+        Reg rd = REG_RA;
+        if (peek_token(st)->kind != TOK_END
+                && is_punct(st, &st->toks[st->tok + 1], ','))
+        {
+            rd = read_reg(st);
+            expect(st, ',');
+        }
+        compile_pcrel_pair(out, st, PSEUDO_JALR, rd, rd,
+                read_symbol_expr(st));
+        break;
+    }
+    case FMT_TAIL:
+        compile_pcrel_pair(out, st, PSEUDO_JALR, REG_ZERO, REG_T1,
+                read_symbol_expr(st));
+        break;
+    default:
+        assert(false);
+    }
+}
@@ -0,0 +1,392 @@
+// Making the branches that do not reach their labels longer.
+//
+// A branch reaches 4 KiB either way and a jal 1 MiB, so every branch and
+// jal to a label is first assembled short.  Once every label is known,
+// the ones that do not reach grow: a branch becomes the opposite branch
+// over a jal, and then over an auipc and jalr through t1 if the jal does
+// not reach either, and a jal becomes an auipc and jalr.  Growing a branch
+// moves the labels after it, which can put other branches out of reach,
+// so this is repeated until nothing grows.  A branch never gets shorter
+// again, so it ends.
+//
+// With the C extension, the branches and jals that have a 16-bit form
+// start out in it, and grow from there: c.beqz and c.bnez reach 256
+// bytes either way, and c.j and c.jal 2 KiB.
+//
+// An alignment after a branch that changes size needs new padding, and
+// so does one in a chunk of a parallel assembly that was assembled as if
+// it started at 0, so the alignments are laid out again with the branches
+// every round.  The padding depends only on what is before it, and the
+// branches only grow, so this still ends.
+//
+// The output is then copied with the new forms and padding in place, and
+// the labels and fixups are moved to match.  The copy is in memory even
+// if the output was written in place, which only far branches and moved
+// alignments cost.
+
+// The branches and alignments that changed size.
+struct Relax {
+    uint64_t *offsets;  // Where each one was, in output order.
+    uint64_t *pos;      // Of an alignment, the offset of its directive in
+                        // the input; UINT64_MAX for a branch.
+    int64_t *before;    // The bytes added before each one, and at the end
+                        // the bytes added in all.
+    size_t n;
+};
+typedef struct Relax Relax;
+
+// A branch or jal to a label, or an alignment.
+struct RelaxItem {
+    size_t index;     // Of its fixup or alignment.
+    uint64_t offset;
+    uint64_t target;  // The label of a branch, and the first item after it.
+    size_t target_item;
+    int32_t grow;     // Bytes it has grown by, -2 for a 16-bit branch.
+    bool align;
+};
+typedef struct RelaxItem RelaxItem;
+
+// Returns the number of the first n that are before the output at offset,
+// and before the code at pos in the input: an alignment at offset is
+// before it if its directive is.
+static size_t
+relax_count_before(const uint64_t *offsets, const uint64_t *pos, size_t n,
+        uint64_t offset, uint64_t at)
+{
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (offsets[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    while (lo < n && offsets[lo] == offset && pos[lo] < at) {
+        lo++;
+    }
+    return lo;
+}
+
+// Returns where the output that was at offset, for the code at pos in
+// the input, has gone.  The offset of a branch that changed size stays
+// at its start.
+static uint64_t
+relax_offset(const Relax *r, uint64_t offset, uint64_t pos)
+{
+    if (!r->n) {
+        return offset;
+    }
+    return offset
+        + r->before[relax_count_before(r->offsets, r->pos, r->n, offset,
+                pos)];
+}
+
+static void
+relax_free(Relax *r)
+{
+    free(r->offsets);
+    free(r->pos);
+    free(r->before);
+}
+
+// Copies the output of src from *pos up to end to dst.  *chunk is the
+// chunk of src that *pos is in, or one before it.  The chunk of an
+// .incbin is moved to dst instead.
+static void
+relax_copy(Output *dst, Output *src, size_t *chunk, uint64_t *pos,
+        uint64_t end)
+{
+    while (*pos < end) {
+        Chunk *c = &src->chunks[*chunk];
+        if (*pos >= c->start + c->len) {
+            (*chunk)++;
+            continue;
+        }
+        uint64_t to = end < c->start + c->len ? end : c->start + c->len;
+        if (c->file && *pos == c->start && to == c->start + c->len) {
+            output_add_chunk(dst, *c);
+            *c = (Chunk){.start = c->start, .len = c->len};
+        } else {
+            output_bytes(dst, c->data + (*pos - c->start), to - *pos);
+        }
+        *pos = to;
+    }
+}
+
+// Grows the branches until they all reach, laying out the alignments
+// every round.  Returns whether any item is not the size it was
+// assembled at.
+static bool
+relax_grow(RelaxItem *items, size_t n, const State *st, int64_t *before)
+{
+    for (bool changed = true; changed;) {
+        changed = false;
+        before[0] = 0;
+        for (size_t i = 0; i < n; i++) {
+            RelaxItem *it = &items[i];
+            if (it->align) {
+                const Align *a = &st->aligns[it->index];
+                it->grow = (int64_t)align_padding(a, a->offset + before[i])
+                    - a->size;
+            }
+            before[i + 1] = before[i] + it->grow;
+        }
+        for (size_t i = 0; i < n; i++) {
+            RelaxItem *b = &items[i];
+            if (b->align) {
+                continue;
+            }
+            int64_t at = b->offset + before[i];
+            int64_t to = b->target + before[b->target_item];
+            FixupKind kind = st->fixups[b->index].kind;
+            int32_t grow = b->grow;
+            if (grow < 0 && !fixup_in_range(kind == FIXUP_B ? FIXUP_CB
+                        : FIXUP_CJ, to - at))
+            {
+                grow = 0;
+            }
+            if (kind == FIXUP_B && grow == 0
+                    && !fixup_in_range(FIXUP_B, to - at))
+            {
+                grow = 4;
+            }
+            // The jal after the opposite branch.
+            if (kind == FIXUP_B && grow == 4
+                    && !fixup_in_range(FIXUP_J, to - (at + 4)))
+            {
+                grow = 8;
+            }
+            if (kind == FIXUP_J && grow == 0
+                    && !fixup_in_range(FIXUP_J, to - at))
+            {
+                grow = 4;
+            }
+            if (grow != b->grow) {
+                b->grow = grow;
+                changed = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].grow) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Emits the branch or jal instr in the form that is grow bytes longer.
+static void
+relax_emit(Output *out, State *st, Target target, uint32_t instr,
+        const Fixup *f, int32_t grow)
+{
+    if (grow < 0) {
+        emit_instr(out, st, (CompiledInstr) {
+            .instr = compress_instr(instr, target),
+            .replace_imm = true,
+            .fixup = {
+                .kind = f->kind == FIXUP_B ? FIXUP_CB : FIXUP_CJ,
+                .sym = f->sym,
+            },
+        });
+        return;
+    }
+    Expr e = {.known = false, .sym = f->sym};
+    if (f->kind == FIXUP_J) {
+        Reg rd = bits(instr, 11, 7);
+        compile_pcrel_pair(out, st, PSEUDO_JALR, rd, rd ? rd : REG_T1, e);
+        return;
+    }
+    // The opposite condition is the one with the lowest bit of funct3
+    // flipped.
+    Reg rs1 = bits(instr, 19, 15);
+    Reg rs2 = bits(instr, 24, 20);
+    emit_instr(out, st, (CompiledInstr) {
+        .instr = instr_type_b(rs1, rs2, 4 + grow)
+            | ((instr & 0x707f) ^ 0x1000),
+    });
+    if (grow == 4) {
+        emit_instr(out, st, (CompiledInstr) {
+            .instr = instr_type_j(REG_ZERO, 0) | PSEUDO_JAL,
+            .replace_imm = true,
+            .fixup = {.kind = FIXUP_J, .sym = f->sym},
+        });
+    } else {
+        compile_pcrel_pair(out, st, PSEUDO_JALR, REG_ZERO, REG_T1, e);
+    }
+}
+
+// Returns the instruction at offset, with the bits of its immediate
+// cleared if it was already resolved.  *chunk is the chunk of out that
+// offset is in, or one before it.
+static uint32_t
+relax_read(const Output *out, size_t *chunk, const Fixup *f, bool resolved)
+{
+    const Chunk *c = &out->chunks[*chunk];
+    while (f->offset >= c->start + c->len) {
+        c = &out->chunks[++*chunk];
+    }
+    const uint8_t *p = c->data + (f->offset - c->start);
+    uint32_t instr = p[0] | p[1] << 8;
+    if (!fixup_is_short(f->kind)) {
+        instr |= p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+    if (resolved) {
+        instr &= ~fixup_bits(f->kind, -1);
+    }
+    return instr;
+}
+
+// Grows the branches and jals that do not reach their labels, and with
+// the C extension shrinks the ones that reach in 16 bits, pads the
+// alignments for where they end up, and fills r with where the output
+// has moved.  The first resolved fixups have already been filled in, and
+// are emptied again.
+static void
+relax_branches(State *st, Output *out, Target target, Relax *r,
+        size_t resolved)
+{
+    *r = (Relax){0};
+    RelaxItem *items = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+    size_t chunk = 0;
+    size_t j = 0;
+    for (size_t i = 0; i <= st->n_fixups; i++) {
+        // The alignments before the fixup, or after the last one.
+        uint64_t end = i < st->n_fixups ? st->fixups[i].offset : UINT64_MAX;
+        for (; j < st->n_aligns && st->aligns[j].offset <= end; j++) {
+            items = grow(items, &cap, n + 1, sizeof *items);
+            items[n++] = (RelaxItem) {
+                .index = j,
+                .offset = st->aligns[j].offset,
+                .align = true,
+            };
+        }
+        if (i == st->n_fixups) {
+            break;
+        }
+        const Fixup *f = &st->fixups[i];
+        const Symbol *sym = &st->symtab.syms[f->sym];
+        if ((f->kind == FIXUP_B || f->kind == FIXUP_J)
+                && sym->kind == SYM_LABEL)
+        {
+            uint32_t instr = relax_read(out, &chunk, f, i < resolved);
+            // It starts out in its 16-bit form if it has one.
+            bool short_form = target & TARGET_C
+                && compress_instr(instr, target) != instr;
+            items = grow(items, &cap, n + 1, sizeof *items);
+            items[n++] = (RelaxItem) {
+                .index = i,
+                .offset = f->offset,
+                .target = sym->value,
+                .grow = short_form ? -2 : 0,
+            };
+        }
+    }
+    r->offsets = malloc(n * sizeof *r->offsets + 1);
+    r->pos = malloc(n * sizeof *r->pos + 1);
+    r->before = malloc((n + 1) * sizeof *r->before);
+    if (!r->offsets || !r->pos || !r->before) {
+        out_of_memory();
+    }
+    for (size_t i = 0; i < n; i++) {
+        r->offsets[i] = items[i].offset;
+        r->pos[i] = items[i].align ? st->aligns[items[i].index].pos
+            : UINT64_MAX;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!items[i].align) {
+            const Fixup *f = &st->fixups[items[i].index];
+            items[i].target_item = relax_count_before(r->offsets, r->pos, n,
+                    items[i].target, st->symtab.syms[f->sym].pos);
+        }
+    }
+    if (!relax_grow(items, n, st, r->before)) {
+        free(items);
+        relax_free(r);
+        *r = (Relax){0};
+        return;
+    }
+
+    // Copy the output, and emit the fixups and alignments again at their
+    // new places.
+    State moved = {0};
+    Output copy = {0};
+    chunk = 0;
+    uint64_t done = 0;
+    size_t k = 0;
+    for (size_t i = 0; i <= st->n_fixups; i++) {
+        const Fixup *f = i < st->n_fixups ? &st->fixups[i] : NULL;
+        for (; k < n && items[k].align && (!f || items[k].offset <= f->offset);
+                k++)
+        {
+            const Align *a = &st->aligns[items[k].index];
+            relax_copy(&copy, out, &chunk, &done, a->offset);
+            done = a->offset + a->size;
+            Align padded = *a;
+            padded.offset = copy.output_len;
+            padded.size = a->size + items[k].grow;
+            assert(padded.size == align_padding(a, copy.output_len));
+            emit_align(&copy, &moved, padded, target);
+        }
+        if (!f) {
+            break;
+        }
+        relax_copy(&copy, out, &chunk, &done, f->offset);
+        done = f->offset + fixup_size(f->kind);
+        if (fixup_is_data(f->kind)) {
+            // Its bytes are all value.
+            emit_data(&copy, &moved, f->kind,
+                    (Expr){.known = false, .sym = f->sym});
+            continue;
+        }
+        uint32_t instr = relax_read(out, &chunk, f, i < resolved);
+        int32_t grow = 0;
+        if (k < n && !items[k].align && items[k].index == i) {
+            grow = items[k++].grow;
+        }
+        if (grow) {
+            relax_emit(&copy, &moved, target, instr, f, grow);
+        } else {
+            emit_instr(&copy, &moved, (CompiledInstr) {
+                .instr = instr,
+                .replace_imm = true,
+                .fixup = *f,
+            });
+        }
+    }
+    relax_copy(&copy, out, &chunk, &done, out->output_len);
+
+    // Keep only the items that changed size.
+    r->before[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].grow) {
+            r->offsets[r->n] = r->offsets[i];
+            r->pos[r->n] = r->pos[i];
+            r->before[r->n + 1] = r->before[r->n] + items[i].grow;
+            r->n++;
+        }
+    }
+    free(items);
+
+    for (size_t i = 0; i < st->symtab.n_syms; i++) {
+        Symbol *sym = &st->symtab.syms[i];
+        if (sym->kind == SYM_LABEL) {
+            sym->value = relax_offset(r, sym->value, sym->pos);
+        }
+    }
+    free(st->fixups);
+    st->fixups = moved.fixups;
+    st->n_fixups = moved.n_fixups;
+    st->cap_fixups = moved.cap_fixups;
+    free(st->aligns);
+    st->aligns = moved.aligns;
+    st->n_aligns = moved.n_aligns;
+    st->cap_aligns = moved.cap_aligns;
+    st->pc = copy.output_len;
+    output_free(out);
+    *out = copy;
+}
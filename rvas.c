@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
 #include <fcntl.h>
@@ -7,6 +8,13 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <setjmp.h>
+#include <getopt.h>
 
 typedef enum {false, true} bool;
 
@@ -33,16 +41,170 @@ str_eq(Str a, Str b)
     return memcmp(a.data, b.data, a.len) == 0;
 }
 
-static int32_t
-str_to_i32(Str s)
+// Used for every name lookup, so it needs to be cheap on the short
+// strings that mnemonics, registers and labels are made of.  It takes
+// eight bytes per step.
+static uint64_t
+str_hash(Str s)
 {
-    int32_t base = 10;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ s.len;
+    size_t i = 0;
+    for (; i + 8 <= s.len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s.data + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    if (i < s.len) {
+        uint64_t w = 0;
+        for (size_t k = 0; i + k < s.len; k++) {
+            w |= (uint64_t)(uint8_t)s.data[i + k] << 8 * k;
+        }
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+// A perfect hash over a fixed set of names, built with hash-and-displace:
+// the hash picks a bucket, and the bucket's displacement sends every key
+// in it to a slot of its own.  A lookup is one hash, two table loads and
+// a single string compare on the candidate, however many keys there are.
+struct PerfectHash {
+    uint64_t seed;
+    size_t n_buckets;
+    size_t n_slots;
+    uint16_t *disp;
+    uint16_t *slots;  // Index of the key plus one, 0 for an empty slot.
+};
+typedef struct PerfectHash PerfectHash;
+
+static uint64_t
+phash_mix(uint64_t h, uint64_t seed)
+{
+    h ^= seed;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool
+phash_try_build(PerfectHash *ph, const uint64_t *hashes, size_t n,
+        uint32_t *order, uint32_t *stamp)
+{
+    memset(ph->disp, 0, ph->n_buckets * sizeof *ph->disp);
+    memset(ph->slots, 0, ph->n_slots * sizeof *ph->slots);
+    memset(stamp, 0, ph->n_slots * sizeof *stamp);
+
+    // Sort the keys by bucket, biggest buckets first, so the crowded
+    // buckets get placed while the table is still empty.
+    size_t *size = calloc(ph->n_buckets, sizeof *size);
+    for (size_t i = 0; i < n; i++) {
+        size[phash_mix(hashes[i], ph->seed) % ph->n_buckets]++;
+    }
+    size_t n_order = 0;
+    for (size_t want = n; want > 0; want--) {
+        for (size_t b = 0; b < ph->n_buckets; b++) {
+            if (size[b] != want) {
+                continue;
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (phash_mix(hashes[i], ph->seed) % ph->n_buckets == b) {
+                    order[n_order++] = i;
+                }
+            }
+        }
+    }
+    free(size);
+
+    uint32_t generation = 0;
+    for (size_t start = 0; start < n;) {
+        uint64_t first = phash_mix(hashes[order[start]], ph->seed);
+        size_t b = first % ph->n_buckets;
+        size_t end = start;
+        while (end < n
+                && phash_mix(hashes[order[end]], ph->seed) % ph->n_buckets == b)
+        {
+            end++;
+        }
+        size_t d;
+        for (d = 0; d < ph->n_slots; d++) {
+            generation++;
+            bool fits = true;
+            for (size_t k = start; k < end && fits; k++) {
+                uint64_t h = phash_mix(hashes[order[k]], ph->seed);
+                size_t slot = ((h >> 32) ^ d) % ph->n_slots;
+                if (ph->slots[slot] || stamp[slot] == generation) {
+                    fits = false;
+                }
+                stamp[slot] = generation;
+            }
+            if (fits) {
+                break;
+            }
+        }
+        if (d == ph->n_slots) {
+            return false;
+        }
+        ph->disp[b] = d;
+        for (size_t k = start; k < end; k++) {
+            uint64_t h = phash_mix(hashes[order[k]], ph->seed);
+            ph->slots[((h >> 32) ^ d) % ph->n_slots] = order[k] + 1;
+        }
+        start = end;
+    }
+    return true;
+}
+
+static void
+phash_build(PerfectHash *ph, const Str *keys, size_t n)
+{
+    ph->n_slots = 4;
+    while (ph->n_slots < 2 * n) {
+        ph->n_slots *= 2;
+    }
+    assert(ph->n_slots <= UINT16_MAX);
+    ph->n_buckets = ph->n_slots / 4;
+    ph->disp = malloc(ph->n_buckets * sizeof *ph->disp);
+    ph->slots = malloc(ph->n_slots * sizeof *ph->slots);
+
+    uint64_t *hashes = malloc(n * sizeof *hashes);
+    uint32_t *order = malloc(n * sizeof *order);
+    uint32_t *stamp = malloc(ph->n_slots * sizeof *stamp);
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = str_hash(keys[i]);
+    }
+    for (ph->seed = 0; !phash_try_build(ph, hashes, n, order, stamp);) {
+        ph->seed++;
+    }
+    free(hashes);
+    free(order);
+    free(stamp);
+}
+
+// Returns the index of the only key that can be equal to the one with
+// hash h, or -1 if there is none.  The caller still has to compare names.
+static ptrdiff_t
+phash_find(const PerfectHash *ph, uint64_t h)
+{
+    h = phash_mix(h, ph->seed);
+    size_t slot = ((h >> 32) ^ ph->disp[h % ph->n_buckets]) % ph->n_slots;
+    return (ptrdiff_t)ph->slots[slot] - 1;
+}
+
+static int64_t
+str_to_i64(Str s)
+{
+    uint64_t base = 10;
     if (s.len >= 2 && s.data[0] == '0' && s.data[1] == 'x') {
         s.data += 2;
         s.len -= 2;
         base = 16;
     }
-    int32_t n = 0;
+    uint64_t n = 0;
     for (size_t i = 0; i < s.len; i++) {
         n *= base;
         char c = s.data[i];
@@ -66,124 +228,597 @@ print_error(const char *fmt, ...)
     va_end(va);
 }
 
-struct UnknownValue {
-    uint32_t *ptr;
-    enum InstrType {
-        INSTR_I, INSTR_J, INSTR_B,
-    } type;
-    Str label;
-    uint64_t relative_to;
-};
-typedef struct UnknownValue UnknownValue;
+// Where to jump when the memory runs out, if the caller can recover from
+// it, as the library does.  Otherwise the program stops.
+static _Thread_local jmp_buf *oom_jump;
+
+static _Noreturn void
+out_of_memory(void)
+{
+    if (oom_jump) {
+        longjmp(*oom_jump, 1);
+    }
+    print_error("Out of memory\n");
+    abort();
+}
+
+// Grows the array at data, which has room for *cap elements of size
+// elem_size, so that it has room for at least need elements.
+static void *
+grow(void *data, size_t *cap, size_t need, size_t elem_size)
+{
+    if (need <= *cap) {
+        return data;
+    }
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    data = realloc(data, new_cap * elem_size);
+    if (!data) {
+        out_of_memory();
+    }
+    *cap = new_cap;
+    return data;
+}
+
+typedef uint32_t SymId;
 
-struct LabelValue {
-    Str label;
-    uint64_t value;
+enum SymKind {
+    SYM_UNDEFINED, SYM_LABEL, SYM_CONST,
 };
-typedef struct LabelValue LabelValue;
+typedef enum SymKind SymKind;
 
-struct Const {
+struct Symbol {
     Str name;
-    int64_t num;
+    uint64_t hash;
+    SymKind kind;
+    int64_t value;
+
+    // Where the symbol was defined: file, line number, and offset of the
+    // name in the input.
+    uint32_t file;
+    size_t line;
+    uint64_t pos;
 };
-typedef struct Const Const;
+typedef struct Symbol Symbol;
 
-struct State {
-    Str code;
-    size_t i;
+// Labels and constants share one table.  Every name is interned the first
+// time it is seen, referenced or defined, so everything after the lexer
+// refers to a symbol by its SymId.  The index is open addressing with
+// linear probing over (hash, id) pairs, so a probe only touches the name
+// when the full hashes match.
+struct SymSlot {
+    uint32_t hash;
+    SymId id;  // Symbol id plus one, 0 for an empty slot.
+};
 
-    uint64_t pc;
+struct Symtab {
+    Symbol *syms;
+    size_t n_syms;
+    size_t cap_syms;
 
-    LabelValue labels[20];
-    size_t n_labels;
+    struct SymSlot *slots;
+    size_t n_slots;  // Power of two.
+};
+typedef struct Symtab Symtab;
 
-#define MAX_UNKNOWNS 40
-    UnknownValue unknowns[MAX_UNKNOWNS];
-    size_t n_unknowns;
+static void
+symtab_rehash(Symtab *tab, size_t n_slots)
+{
+    free(tab->slots);
+    tab->slots = calloc(n_slots, sizeof *tab->slots);
+    if (!tab->slots) {
+        out_of_memory();
+    }
+    tab->n_slots = n_slots;
+    for (size_t id = 0; id < tab->n_syms; id++) {
+        uint64_t h = tab->syms[id].hash;
+        size_t i = h & (n_slots - 1);
+        while (tab->slots[i].id) {
+            i = (i + 1) & (n_slots - 1);
+        }
+        tab->slots[i] = (struct SymSlot){(uint32_t)h, id + 1};
+    }
+}
 
-#define MAX_CONSTS 40
-    Const consts[MAX_CONSTS];
-    size_t n_consts;
+static SymId
+sym_intern(Symtab *tab, Str name, uint64_t hash)
+{
+    // Keep the load factor below one half.
+    if (2 * (tab->n_syms + 1) > tab->n_slots) {
+        symtab_rehash(tab, tab->n_slots ? 2 * tab->n_slots : 64);
+    }
+    size_t mask = tab->n_slots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct SymSlot *slot = &tab->slots[i];
+        if (!slot->id) {
+            tab->syms = grow(tab->syms, &tab->cap_syms, tab->n_syms + 1,
+                    sizeof *tab->syms);
+            tab->syms[tab->n_syms] = (Symbol) {
+                .name = name,
+                .hash = hash,
+                .kind = SYM_UNDEFINED,
+            };
+            tab->n_syms++;
+            *slot = (struct SymSlot){(uint32_t)hash, tab->n_syms};
+            return tab->n_syms - 1;
+        }
+        if (slot->hash == (uint32_t)hash) {
+            Symbol *sym = &tab->syms[slot->id - 1];
+            if (sym->hash == hash && str_eq(sym->name, name)) {
+                return slot->id - 1;
+            }
+        }
+    }
+}
+
+// Like sym_intern, but does not add the name.
+static const Symbol *
+sym_find(const Symtab *tab, Str name, uint64_t hash)
+{
+    if (!tab->n_slots) {
+        return NULL;
+    }
+    size_t mask = tab->n_slots - 1;
+    for (size_t i = hash & mask; tab->slots[i].id; i = (i + 1) & mask) {
+        const struct SymSlot *slot = &tab->slots[i];
+        if (slot->hash == (uint32_t)hash) {
+            const Symbol *sym = &tab->syms[slot->id - 1];
+            if (sym->hash == hash && str_eq(sym->name, name)) {
+                return sym;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void
+symtab_free(Symtab *tab)
+{
+    free(tab->syms);
+    free(tab->slots);
+}
+
+enum FixupKind {
+    FIXUP_I,          // Absolute value in an I-type immediate.
+    FIXUP_S,          // Absolute value in an S-type immediate.
+    FIXUP_J,          // PC-relative offset in a J-type immediate.
+    FIXUP_B,          // PC-relative offset in a B-type immediate.
+    FIXUP_HI,         // %hi: upper 20 bits of the value, for lui.
+    FIXUP_PCREL_HI,   // %pcrel_hi: upper 20 bits of the offset, for auipc.
+    FIXUP_PAIR_LO,    // Lower 12 bits of the offset from the instruction
+                      // before, in an I-type immediate (la, call, tail).
+    FIXUP_PCREL_LO_I, // %pcrel_lo: lower 12 bits of the offset that the
+    FIXUP_PCREL_LO_S, // %pcrel_hi at the label adds, in an I or S-type
+                      // immediate.  The symbol is the label.
+    FIXUP_CB,         // PC-relative offset in c.beqz or c.bnez.
+    FIXUP_CJ,         // PC-relative offset in c.j or c.jal.
+    FIXUP_DATA16,     // Absolute value in a .half, .word or .dword.
+    FIXUP_DATA32,
+    FIXUP_DATA64,
+    N_FIXUP_KINDS,
 };
-typedef struct State State;
+typedef enum FixupKind FixupKind;
+
+// An instruction whose immediate refers to a symbol that is not known yet.
+// The PC base of the relative kinds is the address of the instruction
+// itself, which in a raw image is the same as its output offset, so the
+// offset is all that needs to be stored.  The one exception is %pcrel_lo,
+// whose base is the auipc at its label.
+struct Fixup {
+    uint64_t offset;
+    SymId sym;
+    uint8_t kind;
+};
+typedef struct Fixup Fixup;
+
+// An alignment of the output.  Its padding depends on where it starts,
+// so it is laid out again when the output before it changes size.
+struct Align {
+    uint64_t offset;  // Where the padding starts.
+    uint64_t pos;     // Offset of the directive in the input, which tells
+                      // the labels at offset before it from those after.
+    uint32_t size;    // Bytes of padding.
+    uint32_t align;   // A power of 2.
+    uint32_t max;     // The most padding; it is left out if it needs more.
+    int fill;         // The byte to pad with, or -1 for nops.
+};
+typedef struct Align Align;
+
+// How far a branch of each kind reaches either way.  Only the branches
+// are checked, as they are the ones relaxation can make longer or
+// shorter.
+static const int64_t fixup_reach[N_FIXUP_KINDS] = {
+    [FIXUP_B] = 1 << 12,
+    [FIXUP_J] = 1 << 20,
+    [FIXUP_CB] = 1 << 8,
+    [FIXUP_CJ] = 1 << 11,
+};
+
+// Whether the fixup is in a 16-bit instruction.
+static bool
+fixup_is_short(FixupKind kind)
+{
+    return kind == FIXUP_CB || kind == FIXUP_CJ;
+}
 
+// Whether the fixup is in data rather than in an instruction.
 static bool
+fixup_is_data(FixupKind kind)
+{
+    return kind >= FIXUP_DATA16;
+}
+
+// The number of bytes that a fixup of the kind fills in.
+static int
+fixup_size(FixupKind kind)
+{
+    if (kind == FIXUP_DATA64) {
+        return 8;
+    }
+    return fixup_is_short(kind) || kind == FIXUP_DATA16 ? 2 : 4;
+}
+
+// Whether the value fits the immediate of a fixup of the kind.  It is
+// checked for every fixup, so it does without branches.
+static bool
+fixup_in_range(FixupKind kind, int64_t value)
+{
+    uint64_t reach = fixup_reach[kind];
+    return !reach | ((uint64_t)value + reach < 2 * reach);
+}
+
+static inline bool
 is_letter(char c)
 {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
 }
 
-static bool
+static inline bool
 is_digit(char c)
 {
     return c >= '0' && c <= '9';
 }
 
-static bool
+static inline bool
 is_labelchar(char c)
 {
     return is_letter(c) || is_digit(c) || c == '_';
 }
 
-static bool
+static inline bool
 is_labelstart(char c)
 {
     return is_letter(c) || c == '_';
 }
 
-static bool
+static inline bool
 is_whitespace(char c)
 {
-    return c == ' ' || c == '\t';
+    return c == ' ' || c == '\t' || c == '\r';
 }
 
-static Str
-read_token(State *st)
+#include "scan.c"
+
+enum TokenKind {
+    TOK_NAME,    // Mnemonic, register, symbol or directive name.
+    TOK_NUMBER,
+    TOK_STRING,  // "..." including the quotes.
+    TOK_CHAR,    // '...' including the quotes.
+    TOK_PUNCT,   // Any other single character.
+    TOK_END,     // End of the line.
+};
+typedef enum TokenKind TokenKind;
+
+struct Token {
+    uint64_t hash;   // str_hash of the text, only for TOK_NAME.
+    uint32_t start;  // Offset from the start of the line.
+    uint32_t len;
+    uint8_t kind;
+};
+typedef struct Token Token;
+
+// An input file.
+struct Source {
+    const char *name;
+    Str code;
+};
+typedef struct Source Source;
+
+struct Diag {
+    uint32_t file;
+    size_t line;  // 0 if the error is not about a line.
+    char *msg;
+    size_t seq;   // Only used for sorting.
+};
+typedef struct Diag Diag;
+
+struct State {
+    Str code;
+    size_t i;  // Start of the next line.
+
+    // Index of the file the code is from, and offset of the code in the
+    // input, which is all the files one after the other.
+    uint32_t file;
+    uint64_t pos_base;
+
+    // The tokens of the current line, always ending with a TOK_END.
+    Scanner scanner;
+    const char *line_start;
+    Token *toks;
+    size_t n_toks;
+    size_t cap_toks;
+    size_t tok;  // The next token to read.
+
+    uint64_t pc;
+
+    Symtab symtab;
+
+    // In a chunk of a parallel assembly, the constants of the whole code,
+    // which were defined before the chunks were started.
+    const Symtab *consts;
+
+    Fixup *fixups;
+    size_t n_fixups;
+    size_t cap_fixups;
+
+    Align *aligns;
+    size_t n_aligns;
+    size_t cap_aligns;
+
+    // Whether an .incbin read a file, which the cache does not know of.
+    bool incbin;
+    // .incbin is an error, for code that must not read files.
+    bool no_incbin;
+
+    // In a stream, the line of every fixup, and the labels defined, in
+    // order, since the stream last took them.
+    bool stream;
+    size_t *fixup_lines;
+    size_t cap_fixup_lines;
+    SymId *labels;
+    size_t n_labels;
+    size_t cap_labels;
+
+    size_t line;
+    Diag *diags;
+    size_t n_errors;
+    size_t cap_diags;
+};
+typedef struct State State;
+
+static void
+report(State *st, uint32_t file, size_t line, const char *fmt, va_list va)
 {
-    size_t i = st->i;
-    while (i < st->code.len && is_whitespace(st->code.data[i])) {
-        i++;
+    va_list copy;
+    va_copy(copy, va);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    char *msg = malloc(len + 1);
+    if (!msg) {
+        out_of_memory();
     }
-    if(i < st->code.len && st->code.data[i] == ';') {
-        while (i < st->code.len && st->code.data[i] != '\n') {
-            i++;
+    vsnprintf(msg, len + 1, fmt, va);
+    st->diags = grow(st->diags, &st->cap_diags, st->n_errors + 1,
+            sizeof *st->diags);
+    st->diags[st->n_errors] = (Diag){file, line, msg};
+    st->n_errors++;
+}
+
+// Reports the first error of a line.  Later ones are usually caused by
+// the first, so they are dropped.
+static void
+error(State *st, const char *fmt, ...)
+{
+    if (st->n_errors && st->diags[st->n_errors - 1].line == st->line) {
+        return;
+    }
+    va_list va;
+    va_start(va, fmt);
+    report(st, st->file, st->line, fmt, va);
+    va_end(va);
+}
+
+// Reports an error that is found after the line it is about has been
+// read, or that is not about any line if line is 0.
+static void
+error_at(State *st, uint32_t file, size_t line, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    report(st, file, line, fmt, va);
+    va_end(va);
+}
+
+static int
+diag_cmp(const void *a, const void *b)
+{
+    const Diag *da = a;
+    const Diag *db = b;
+    // Errors without a line come last; otherwise keep the order in which
+    // they were reported.
+    if (!da->line != !db->line) {
+        return da->line ? -1 : 1;
+    }
+    if (da->line && da->file != db->file) {
+        return da->file < db->file ? -1 : 1;
+    }
+    size_t la = da->line;
+    size_t lb = db->line;
+    if (la != lb) {
+        return la < lb ? -1 : 1;
+    }
+    return da->seq < db->seq ? -1 : da->seq > db->seq;
+}
+
+// Puts the errors in line order, keeping only the first of each line.
+static void
+sort_diags(State *st)
+{
+    if (!st->n_errors) {
+        return;
+    }
+    for (size_t i = 0; i < st->n_errors; i++) {
+        st->diags[i].seq = i;
+    }
+    qsort(st->diags, st->n_errors, sizeof *st->diags, diag_cmp);
+    size_t n = 0;
+    for (size_t i = 0; i < st->n_errors; i++) {
+        Diag *d = &st->diags[i];
+        if (n && d->line && d->line == st->diags[n - 1].line
+                && d->file == st->diags[n - 1].file)
+        {
+            free(d->msg);
+            continue;
         }
+        st->diags[n++] = *d;
     }
+    st->n_errors = n;
+}
 
-    char first = st->code.data[i];
-    size_t token_start = i;
-    if (is_labelstart(first)) {
-        while (i < st->code.len && is_labelchar(st->code.data[i])) {
-            i++;
+#ifndef RVAS_LIBRARY
+// Prints the errors in line order and frees them.  The files are only
+// named if there are several.
+static void
+print_diags(State *st, const Source *sources, size_t n_sources)
+{
+    sort_diags(st);
+    for (size_t i = 0; i < st->n_errors; i++) {
+        const Diag *d = &st->diags[i];
+        if (d->line && n_sources > 1) {
+            fprintf(stderr, "%s: line %zu: %s\n", sources[d->file].name,
+                    d->line, d->msg);
+        } else if (d->line) {
+            fprintf(stderr, "line %zu: %s\n", d->line, d->msg);
+        } else {
+            fprintf(stderr, "%s\n", d->msg);
         }
-    } else if (is_digit(first)) {
-        while (i < st->code.len
-                && (is_digit(st->code.data[i])
-                    || is_letter(st->code.data[i])))
-        {
-            i++;
+        free(d->msg);
+    }
+    free(st->diags);
+    st->diags = NULL;
+    st->n_errors = 0;
+    st->cap_diags = 0;
+}
+#endif
+
+// Splits the next line of the code into tokens.  The parser reads them
+// with read_token and peek_token, so it can look ahead as far as it
+// wants within the line without scanning the text again.  Returns false
+// at the end of the code.
+static bool
+lex_line(State *st)
+{
+    const char *code = st->code.data;
+    size_t len = st->code.len;
+    size_t start = st->i;
+    if (start >= len) {
+        return false;
+    }
+    st->line++;
+    st->line_start = code + start;
+
+    // Work on local copies, so the stores to the tokens cannot make the
+    // compiler reload them.
+    Scanner sc = st->scanner;
+    Token *toks = st->toks;
+    size_t cap = st->cap_toks;
+    size_t n = 0;
+    size_t i = start;
+    for (;;) {
+        i = scan_class(&sc, i, CLASS_SPACE);
+        if (i < len && code[i] == ';') {
+            i = scan_to(&sc, i, CLASS_NEWLINE);
         }
-    } else if (first == '"') {
-        i++;
-        while (i < st->code.len && st->code.data[i] != '"') {
-            i++;
+        if (n == cap) {
+            toks = grow(toks, &cap, n + 1, sizeof *toks);
         }
-        if (i < st->code.len) {
-            i++;
+        Token *t = &toks[n++];
+        Token tok = {.start = i - start};
+        if (i == len || code[i] == '\n') {
+            tok.kind = TOK_END;
+            *t = tok;
+            break;
         }
-    } else if (first == '\'') {
-        i++;
-        while (i < st->code.len && st->code.data[i] != '\'') {
+
+        char first = code[i];
+        if (is_labelstart(first)) {
+            i = scan_class(&sc, i + 1, CLASS_NAME);
+            tok.kind = TOK_NAME;
+            tok.hash = str_hash((Str){code + start + tok.start,
+                    i - start - tok.start});
+        } else if (is_digit(first)) {
+            i = scan_class(&sc, i + 1, CLASS_NUMBER);
+            tok.kind = TOK_NUMBER;
+        } else if (first == '"' || first == '\'') {
             i++;
-        }
-        if (i < st->code.len) {
+            while (i < len && code[i] != first && code[i] != '\n') {
+                i++;
+            }
+            if (i < len && code[i] == first) {
+                i++;
+            }
+            tok.kind = first == '"' ? TOK_STRING : TOK_CHAR;
+        } else {
             i++;
+            tok.kind = TOK_PUNCT;
         }
-    } else if (i < st->code.len) {
-        i++;
+        tok.len = i - start - tok.start;
+        *t = tok;
+    }
+    st->scanner = sc;
+    st->toks = toks;
+    st->cap_toks = cap;
+    st->n_toks = n;
+    st->tok = 0;
+    st->i = i + 1;
+    return true;
+}
+
+static Str
+tok_str(const State *st, const Token *t)
+{
+    return (Str){st->line_start + t->start, t->len};
+}
+
+// Offset of the token in the input.
+static uint64_t
+tok_pos(const State *st, const Token *t)
+{
+    return st->pos_base + (st->line_start - st->code.data) + t->start;
+}
+
+static const Token *
+peek_token(const State *st)
+{
+    return &st->toks[st->tok];
+}
+
+static const Token *
+read_token(State *st)
+{
+    const Token *t = &st->toks[st->tok];
+    if (t->kind != TOK_END) {
+        st->tok++;
+    }
+    return t;
+}
+
+static bool
+is_punct(const State *st, const Token *t, char c)
+{
+    return t->kind == TOK_PUNCT && st->line_start[t->start] == c;
+}
+
+static void
+expect(State *st, char c)
+{
+    const Token *t = read_token(st);
+    if (!is_punct(st, t, c)) {
+        Str s = tok_str(st, t);
+        error(st, "Expected '%c': %.*s", c, (int)s.len, s.data);
     }
-    st->i = i;
-    return (Str){st->code.data + token_start, i - token_start};
 }
 
 enum Reg {
@@ -198,656 +833,1835 @@ enum Reg {
 };
 typedef enum Reg Reg;
 
+struct RegName {
+    const char *name;
+    Reg reg;
+};
+
+static const struct RegName reg_names[] = {
+    {"zero",   REG_ZERO}, {"x0",  REG_ZERO},
+    {"ra",     REG_RA  }, {"x1",  REG_RA},
+    {"sp",     REG_SP  }, {"x2",  REG_SP},
+    {"gp",     REG_GP  }, {"x3",  REG_GP},
+    {"tp",     REG_TP  }, {"x4",  REG_TP},
+    {"t0",     REG_T0  }, {"x5",  REG_T0},
+    {"t1",     REG_T1  }, {"x6",  REG_T1},
+    {"t2",     REG_T2  }, {"x7",  REG_T2},
+    {"s0",     REG_S0  }, {"x8",  REG_S0},
+    {"s1",     REG_S1  }, {"x9",  REG_S1},
+    {"a0",     REG_A0  }, {"x10", REG_A0},
+    {"a1",     REG_A1  }, {"x11", REG_A1},
+    {"a2",     REG_A2  }, {"x12", REG_A2},
+    {"a3",     REG_A3  }, {"x13", REG_A3},
+    {"a4",     REG_A4  }, {"x14", REG_A4},
+    {"a5",     REG_A5  }, {"x15", REG_A5},
+    {"a6",     REG_A6  }, {"x16", REG_A6},
+    {"a7",     REG_A7  }, {"x17", REG_A7},
+    {"s2",     REG_S2  }, {"x18", REG_S2},
+    {"s3",     REG_S3  }, {"x19", REG_S3},
+    {"s4",     REG_S4  }, {"x20", REG_S4},
+    {"s5",     REG_S5  }, {"x21", REG_S5},
+    {"s6",     REG_S6  }, {"x22", REG_S6},
+    {"s7",     REG_S7  }, {"x23", REG_S7},
+    {"s8",     REG_S8  }, {"x24", REG_S8},
+    {"s9",     REG_S9  }, {"x25", REG_S9},
+    {"s10",    REG_S10 }, {"x26", REG_S10},
+    {"s11",    REG_S11 }, {"x27", REG_S11},
+    {"t3",     REG_T3  }, {"x28", REG_T3},
+    {"t4",     REG_T4  }, {"x29", REG_T4},
+    {"t5",     REG_T5  }, {"x30", REG_T5},
+    {"t6",     REG_T6  }, {"x31", REG_T6},
+    {"fp",     REG_S0},
+};
+
+static PerfectHash reg_hash;
+
+typedef uint32_t Csr;
+
+struct CsrName {
+    const char *name;
+    Csr csr;
+};
+
+static const struct CsrName csr_names[] = {
+    {"ustatus",        0x000},
+    {"uie",            0x004},
+    {"utvec",          0x005},
+    {"uscratch",       0x040},
+    {"uepc",           0x041},
+    {"ucause",         0x042},
+    {"utval",          0x043},
+    {"uip",            0x044},
+    {"fflags",         0x001},
+    {"frm",            0x002},
+    {"fcsr",           0x003},
+    {"cycle",          0xC00},
+    {"time",           0xC01},
+    {"instret",        0xC02},
+    {"cycleh",         0xC80},
+    {"timeh",          0xC81},
+    {"instreth",       0xC82},
+    {"sstatus",        0x100},
+    {"sedeleg",        0x102},
+    {"sideleg",        0x103},
+    {"sie",            0x104},
+    {"stvec",          0x105},
+    {"scounteren",     0x106},
+    {"sscratch",       0x140},
+    {"sepc",           0x141},
+    {"scause",         0x142},
+    {"stval",          0x143},
+    {"sip",            0x144},
+    {"satp",           0x180},
+    {"hstatus",        0x600},
+    {"hedeleg",        0x602},
+    {"hideleg",        0x603},
+    {"hcounteren",     0x606},
+    {"hgatp",          0x680},
+    {"htimedelta",     0x605},
+    {"htimedeltah",    0x615},
+    {"vsstatus",       0x200},
+    {"vsie",           0x204},
+    {"vstvec",         0x205},
+    {"vsscratch",      0x240},
+    {"vsepc",          0x241},
+    {"vscause",        0x242},
+    {"vstval",         0x243},
+    {"vsip",           0x244},
+    {"vsatp",          0x280},
+    {"mvendorid",      0xF11},
+    {"marchid",        0xF12},
+    {"mimpid",         0xF13},
+    {"mhartid",        0xF14},
+    {"mstatus",        0x300},
+    {"misa",           0x301},
+    {"medeleg",        0x302},
+    {"mideleg",        0x303},
+    {"mie",            0x304},
+    {"mtvec",          0x305},
+    {"mcounteren",     0x306},
+    {"mstatush",       0x310},
+    {"mscratch",       0x340},
+    {"mepc",           0x341},
+    {"mcause",         0x342},
+    {"mtval",          0x343},
+    {"mip",            0x344},
+    {"mcycle",         0xB00},
+    {"minstret",       0xB02},
+    {"mcycleh",        0xB80},
+    {"minstreth",      0xB82},
+    {"mcountinhibit",  0x320},
+    {"tselect",        0x7A0},
+    {"tdata1",         0x7A1},
+    {"tdata2",         0x7A2},
+    {"tdata3",         0x7A3},
+    {"dcsr",           0x7B0},
+    {"dpc",            0x7B1},
+    {"dscratch0",      0x7B2},
+    {"dscratch1",      0x7B3},
+};
+
+// Numbered CSRs, e.g. hpmcounter3 to hpmcounter31.
+static const struct CsrFamily {
+    const char *prefix;
+    const char *suffix;
+    Csr base;
+    uint32_t first, last;
+} csr_families[] = {
+    {"hpmcounter",  "",  0xC00, 3, 31},
+    {"hpmcounter",  "h", 0xC80, 3, 31},
+    {"mhpmcounter", "",  0xB00, 3, 31},
+    {"mhpmcounter", "h", 0xB80, 3, 31},
+    {"mhpmevent",   "",  0x320, 3, 31},
+    {"pmpcfg",      "",  0x3A0, 0, 15},
+    {"pmpaddr",     "",  0x3B0, 0, 63},
+};
+
+static struct CsrName *csrs;
+static size_t n_csrs;
+static PerfectHash csr_hash;
+
+static void
+names_init(void)
+{
+    Str names[ARR_SIZE(reg_names)];
+    for (size_t i = 0; i < ARR_SIZE(reg_names); i++) {
+        names[i] = str(reg_names[i].name);
+    }
+    phash_build(&reg_hash, names, ARR_SIZE(reg_names));
+
+    size_t n = ARR_SIZE(csr_names);
+    for (size_t f = 0; f < ARR_SIZE(csr_families); f++) {
+        n += csr_families[f].last - csr_families[f].first + 1;
+    }
+    csrs = malloc(n * sizeof *csrs);
+    memcpy(csrs, csr_names, sizeof csr_names);
+    n_csrs = ARR_SIZE(csr_names);
+    for (size_t f = 0; f < ARR_SIZE(csr_families); f++) {
+        const struct CsrFamily *fam = &csr_families[f];
+        for (uint32_t k = fam->first; k <= fam->last; k++) {
+            char buf[32];
+            snprintf(buf, sizeof buf, "%s%u%s", fam->prefix, k, fam->suffix);
+            csrs[n_csrs++] = (struct CsrName){strdup(buf), fam->base + k};
+        }
+    }
+    Str *csr_keys = malloc(n_csrs * sizeof *csr_keys);
+    for (size_t i = 0; i < n_csrs; i++) {
+        csr_keys[i] = str(csrs[i].name);
+    }
+    phash_build(&csr_hash, csr_keys, n_csrs);
+    free(csr_keys);
+}
+
 static Reg
 read_reg(State *st)
 {
-    Str s = read_token(st);
-    if      (str_eq(s, str("zero"))) { return REG_ZERO; }
-    else if (str_eq(s, str("ra")))   { return REG_RA; }
-    else if (str_eq(s, str("sp")))   { return REG_SP; }
-    else if (str_eq(s, str("gp")))   { return REG_GP; }
-    else if (str_eq(s, str("tp")))   { return REG_TP; }
-    else if (str_eq(s, str("t0")))   { return REG_T0; }
-    else if (str_eq(s, str("t1")))   { return REG_T1; }
-    else if (str_eq(s, str("t2")))   { return REG_T2; }
-    else if (str_eq(s, str("s0")))   { return REG_S0; }
-    else if (str_eq(s, str("s1")))   { return REG_S1; }
-    else if (str_eq(s, str("a0")))   { return REG_A0; }
-    else if (str_eq(s, str("a1")))   { return REG_A1; }
-    else if (str_eq(s, str("a2")))   { return REG_A2; }
-    else if (str_eq(s, str("a3")))   { return REG_A3; }
-    else if (str_eq(s, str("a4")))   { return REG_A4; }
-    else if (str_eq(s, str("a5")))   { return REG_A5; }
-    else if (str_eq(s, str("a6")))   { return REG_A6; }
-    else if (str_eq(s, str("a7")))   { return REG_A7; }
-    else if (str_eq(s, str("s2")))   { return REG_S2; }
-    else if (str_eq(s, str("s3")))   { return REG_S3; }
-    else if (str_eq(s, str("s4")))   { return REG_S4; }
-    else if (str_eq(s, str("s5")))   { return REG_S5; }
-    else if (str_eq(s, str("s6")))   { return REG_S6; }
-    else if (str_eq(s, str("s7")))   { return REG_S7; }
-    else if (str_eq(s, str("s8")))   { return REG_S8; }
-    else if (str_eq(s, str("s9")))   { return REG_S9; }
-    else if (str_eq(s, str("s10")))  { return REG_S10; }
-    else if (str_eq(s, str("s11")))  { return REG_S11; }
-    else if (str_eq(s, str("t3")))   { return REG_T3; }
-    else if (str_eq(s, str("t4")))   { return REG_T4; }
-    else if (str_eq(s, str("t5")))   { return REG_T5; }
-    else if (str_eq(s, str("t6")))   { return REG_T6; }
-    else {
-        print_error("Unknown register: %.*s\n", (int)s.len, s.data);
+    const Token *t = read_token(st);
+    Str s = tok_str(st, t);
+    ptrdiff_t i = t->kind == TOK_NAME ? phash_find(&reg_hash, t->hash) : -1;
+    if (i < 0 || !str_eq(str(reg_names[i].name), s)) {
+        error(st, "Unknown register: %.*s", (int)s.len, s.data);
+        return REG_ZERO;
     }
+    return reg_names[i].reg;
 }
 
-typedef uint32_t Csr;
-
 static Csr
 read_csr(State *st)
 {
-    Str s = read_token(st);
-    if (str_eq(s, str("ustatus")))             { return 0x000; }
-    else if (str_eq(s, str("uie")))            { return 0x004; }
-    else if (str_eq(s, str("utvec")))          { return 0x005; }
-    else if (str_eq(s, str("uscratch")))       { return 0x040; }
-    else if (str_eq(s, str("uepc")))           { return 0x041; }
-    else if (str_eq(s, str("ucause")))         { return 0x042; }
-    else if (str_eq(s, str("utval")))          { return 0x043; }
-    else if (str_eq(s, str("uip")))            { return 0x044; }
-    else if (str_eq(s, str("fflags")))         { return 0x001; }
-    else if (str_eq(s, str("frm")))            { return 0x002; }
-    else if (str_eq(s, str("fcsr")))           { return 0x003; }
-    else if (str_eq(s, str("cycle")))          { return 0xC00; }
-    else if (str_eq(s, str("time")))           { return 0xC01; }
-    else if (str_eq(s, str("instret")))        { return 0xC02; }
-    else if (str_eq(s, str("hpmcounter3")))    { return 0xC03; }
-    else if (str_eq(s, str("hpmcounter4")))    { return 0xC04; }
-    else if (str_eq(s, str("hpmcounter31")))   { return 0xC1F; }
-    else if (str_eq(s, str("cycleh")))         { return 0xC80; }
-    else if (str_eq(s, str("timeh")))          { return 0xC81; }
-    else if (str_eq(s, str("instreth")))       { return 0xC82; }
-    else if (str_eq(s, str("hpmcounter3h")))   { return 0xC83; }
-    else if (str_eq(s, str("hpmcounter4h")))   { return 0xC84; }
-    else if (str_eq(s, str("hpmcounter31h")))  { return 0xC9F; }
-    else if (str_eq(s, str("sstatus")))        { return 0x100; }
-    else if (str_eq(s, str("sedeleg")))        { return 0x102; }
-    else if (str_eq(s, str("sideleg")))        { return 0x103; }
-    else if (str_eq(s, str("sie")))            { return 0x104; }
-    else if (str_eq(s, str("stvec")))          { return 0x105; }
-    else if (str_eq(s, str("scounteren")))     { return 0x106; }
-    else if (str_eq(s, str("sscratch")))       { return 0x140; }
-    else if (str_eq(s, str("sepc")))           { return 0x141; }
-    else if (str_eq(s, str("scause")))         { return 0x142; }
-    else if (str_eq(s, str("stval")))          { return 0x143; }
-    else if (str_eq(s, str("sip")))            { return 0x144; }
-    else if (str_eq(s, str("satp")))           { return 0x180; }
-    else if (str_eq(s, str("hstatus")))        { return 0x600; }
-    else if (str_eq(s, str("hedeleg")))        { return 0x602; }
-    else if (str_eq(s, str("hideleg")))        { return 0x603; }
-    else if (str_eq(s, str("hcounteren")))     { return 0x606; }
-    else if (str_eq(s, str("hgatp")))          { return 0x680; }
-    else if (str_eq(s, str("htimedelta")))     { return 0x605; }
-    else if (str_eq(s, str("htimedeltah")))    { return 0x615; }
-    else if (str_eq(s, str("vsstatus")))       { return 0x200; }
-    else if (str_eq(s, str("vsie")))           { return 0x204; }
-    else if (str_eq(s, str("vstvec")))         { return 0x205; }
-    else if (str_eq(s, str("vsscratch")))      { return 0x240; }
-    else if (str_eq(s, str("vsepc")))          { return 0x241; }
-    else if (str_eq(s, str("vscause")))        { return 0x242; }
-    else if (str_eq(s, str("vstval")))         { return 0x243; }
-    else if (str_eq(s, str("vsip")))           { return 0x244; }
-    else if (str_eq(s, str("vsatp")))          { return 0x280; }
-    else if (str_eq(s, str("mvendorid")))      { return 0xF11; }
-    else if (str_eq(s, str("marchid")))        { return 0xF12; }
-    else if (str_eq(s, str("mimpid")))         { return 0xF13; }
-    else if (str_eq(s, str("mhartid")))        { return 0xF14; }
-    else if (str_eq(s, str("mstatus")))        { return 0x300; }
-    else if (str_eq(s, str("misa")))           { return 0x301; }
-    else if (str_eq(s, str("medeleg")))        { return 0x302; }
-    else if (str_eq(s, str("mideleg")))        { return 0x303; }
-    else if (str_eq(s, str("mie")))            { return 0x304; }
-    else if (str_eq(s, str("mtvec")))          { return 0x305; }
-    else if (str_eq(s, str("mcounteren")))     { return 0x306; }
-    else if (str_eq(s, str("mstatush")))       { return 0x310; }
-    else if (str_eq(s, str("mscratch")))       { return 0x340; }
-    else if (str_eq(s, str("mepc")))           { return 0x341; }
-    else if (str_eq(s, str("mcause")))         { return 0x342; }
-    else if (str_eq(s, str("mtval")))          { return 0x343; }
-    else if (str_eq(s, str("mip")))            { return 0x344; }
-    else if (str_eq(s, str("pmpcfg0")))        { return 0x3A0; }
-    else if (str_eq(s, str("pmpcfg1")))        { return 0x3A1; }
-    else if (str_eq(s, str("pmpcfg2")))        { return 0x3A2; }
-    else if (str_eq(s, str("pmpcfg3")))        { return 0x3A3; }
-    else if (str_eq(s, str("pmpaddr0")))       { return 0x3B0; }
-    else if (str_eq(s, str("pmpaddr1")))       { return 0x3B1; }
-    else if (str_eq(s, str("pmpaddr15")))      { return 0x3BF; }
-    else if (str_eq(s, str("mcycle")))         { return 0xB00; }
-    else if (str_eq(s, str("minstret")))       { return 0xB02; }
-    else if (str_eq(s, str("mhpmcounter3")))   { return 0xB03; }
-    else if (str_eq(s, str("mhpmcounter4")))   { return 0xB04; }
-    else if (str_eq(s, str("mhpmcounter31")))  { return 0xB1F; }
-    else if (str_eq(s, str("mcycleh")))        { return 0xB80; }
-    else if (str_eq(s, str("minstreth")))      { return 0xB82; }
-    else if (str_eq(s, str("mhpmcounter3h")))  { return 0xB83; }
-    else if (str_eq(s, str("mhpmcounter4h")))  { return 0xB84; }
-    else if (str_eq(s, str("mhpmcounter31h"))) { return 0xB9F; }
-    else if (str_eq(s, str("mcountinhibit")))  { return 0x320; }
-    else if (str_eq(s, str("mhpmevent3")))     { return 0x323; }
-    else if (str_eq(s, str("mhpmevent4")))     { return 0x324; }
-    else if (str_eq(s, str("mhpmevent31")))    { return 0x33F; }
-    else if (str_eq(s, str("tselect")))        { return 0x7A0; }
-    else if (str_eq(s, str("tdata1")))         { return 0x7A1; }
-    else if (str_eq(s, str("tdata2")))         { return 0x7A2; }
-    else if (str_eq(s, str("tdata3")))         { return 0x7A3; }
-    else if (str_eq(s, str("dcsr")))           { return 0x7B0; }
-    else if (str_eq(s, str("dpc")))            { return 0x7B1; }
-    else if (str_eq(s, str("dscratch0")))      { return 0x7B2; }
-    else if (str_eq(s, str("dscratch1")))      { return 0x7B3; }
-    else {
-        print_error("Unknown csr: %.*s\n", (int)s.len, s.data);
+    const Token *t = read_token(st);
+    Str s = tok_str(st, t);
+    if (t->kind == TOK_NUMBER) {
+        int64_t n = str_to_i64(s);
+        if (n < 0 || n > 0xFFF) {
+            error(st, "CSR address out of range: %.*s", (int)s.len, s.data);
+            return 0;
+        }
+        return n;
+    }
+    ptrdiff_t i = t->kind == TOK_NAME ? phash_find(&csr_hash, t->hash) : -1;
+    if (i < 0 || !str_eq(str(csrs[i].name), s)) {
+        error(st, "Unknown csr: %.*s", (int)s.len, s.data);
+        return 0;
     }
+    return csrs[i].csr;
 }
 
 static uint32_t
-parse_quoted_char(Str token)
+parse_quoted_char(State *st, Str token)
 {
-    assert(token.len == 3);
-    assert(token.data[0] == '\'');
-    assert(token.data[2] == '\'');
+    if (token.len != 3 || token.data[2] != '\'') {
+        error(st, "Bad character constant: %.*s", (int)token.len, token.data);
+        return 0;
+    }
     return token.data[1];
 }
 
-static Const *
-get_const(const State *st, Str name)
-{
-    for (size_t i = 0; i < st->n_consts; i++) {
-        Const *c = &st->consts[i];
-        if (str_eq(c->name, name)) {
-            return c;
-        }
-    }
-    return NULL;
-}
+// A %name(...) around an expression, which picks a part of its value.
+enum Reloc {
+    RELOC_NONE,
+    RELOC_HI,        // The upper 20 bits, for lui.
+    RELOC_LO,        // The lower 12 bits.
+    RELOC_PCREL_HI,  // The upper 20 bits of the offset, for auipc.
+    RELOC_PCREL_LO,  // The lower 12 bits of what the auipc at a label adds.
+};
+typedef enum Reloc Reloc;
+
+static const char *reloc_names[] = {
+    [RELOC_HI] = "hi",
+    [RELOC_LO] = "lo",
+    [RELOC_PCREL_HI] = "pcrel_hi",
+    [RELOC_PCREL_LO] = "pcrel_lo",
+};
 
 struct Expr {
     bool known;
+    Reloc reloc;
     union {
-        int32_t result;  // if known
-        Str label;       // if not known
+        int64_t result;  // if known
+        SymId sym;       // if not known
     };
 };
 typedef struct Expr Expr;
 
+// Reads a symbol, even one that is a constant, so that its use is
+// always a fixup.
+static Expr
+read_symbol_expr(State *st)
+{
+    const Token *t = read_token(st);
+    if (t->kind != TOK_NAME) {
+        Str s = tok_str(st, t);
+        error(st, "Expected a symbol: %.*s", (int)s.len, s.data);
+        return (Expr){.known = true};
+    }
+    return (Expr) {
+        .known = false,
+        .sym = sym_intern(&st->symtab, tok_str(st, t), t->hash),
+    };
+}
+
 static Expr
 read_expr(State *st)
 {
-    Str t1 = read_token(st);
-    const Const *c = get_const(st, t1);
-    if (c) {
+    if (is_punct(st, peek_token(st), '%')) {
+        read_token(st);
+        const Token *t = read_token(st);
+        Str s = tok_str(st, t);
+        Reloc reloc = RELOC_NONE;
+        for (size_t i = 1; i < ARR_SIZE(reloc_names); i++) {
+            if (t->kind == TOK_NAME && str_eq(s, str(reloc_names[i]))) {
+                reloc = i;
+            }
+        }
+        if (!reloc) {
+            error(st, "Unknown relocation: %%%.*s", (int)s.len, s.data);
+            return (Expr){.known = true};
+        }
+        expect(st, '(');
+        // The pc-relative ones are only known once the code is laid out.
+        Expr e = reloc == RELOC_PCREL_HI || reloc == RELOC_PCREL_LO
+            ? read_symbol_expr(st) : read_expr(st);
+        expect(st, ')');
+        if (e.reloc) {
+            error(st, "Expected an expression in %%%s", reloc_names[reloc]);
+        }
+        if (e.known && reloc == RELOC_HI) {
+            e.result = (e.result + 0x800) >> 12;
+        } else if (e.known && reloc == RELOC_LO) {
+            // Sign-extended, as the instructions take it, to go with %hi.
+            e.result = (int64_t)((uint64_t)e.result << 52) >> 52;
+        }
+        e.reloc = reloc;
+        return e;
+    }
+
+    const Token *t = read_token(st);
+    Str s = tok_str(st, t);
+    if (t->kind == TOK_NAME) {
+        if (st->consts) {
+            const Symbol *c = sym_find(st->consts, s, t->hash);
+            if (c && c->kind == SYM_CONST && c->pos < tok_pos(st, t)) {
+                return (Expr) {
+                    .known = true,
+                    .result = c->value,
+                };
+            }
+        }
+        SymId id = sym_intern(&st->symtab, s, t->hash);
+        const Symbol *sym = &st->symtab.syms[id];
+        if (sym->kind == SYM_CONST) {
+            return (Expr) {
+                .known = true,
+                .result = sym->value,
+            };
+        }
         return (Expr) {
-            .known = true,
-            .result = c->num,
+            .known = false,
+            .sym = id,
         };
-    } else if (t1.len && t1.data[0] == '\'') {
-        uint32_t c = parse_quoted_char(t1);
+    } else if (t->kind == TOK_CHAR) {
         return (Expr) {
             .known = true,
-            .result = c,
+            .result = parse_quoted_char(st, s),
         };
-    } else if (t1.len) {
-        if (is_labelstart(t1.data[0])) {
+    } else {
+        int sign = 1;
+        if (is_punct(st, t, '-')) {
+            sign = -1;
+            t = read_token(st);
+            s = tok_str(st, t);
+        }
+        if (t->kind == TOK_NUMBER) {
+            uint64_t n = str_to_i64(s);
             return (Expr) {
-                .known = false,
-                .label = t1,
+                .known = true,
+                .result = sign < 0 ? -n : n,
             };
-        } else {
-            Str n = t1;
-            int sign = 1;
-            if (t1.data[0] == '-') {
-                sign = -1;
-                n = read_token(st);
-            }
-            if (n.len &&  is_digit(n.data[0])) {
-                return (Expr) {
-                    .known = true,
-                    .result = str_to_i32(n) * sign,
-                };
-            }
         }
     }
+    error(st, "Expected expression: %.*s", (int)s.len, s.data);
+    return (Expr) {
+        .known = true,
+        .result = 0,
+    };
+}
+
+// Reads a string in double quotes, and returns it without them.
+static bool
+read_string(State *st, Str *s)
+{
+    const Token *t = read_token(st);
+    *s = tok_str(st, t);
+    if (t->kind != TOK_STRING || s->len < 2 || s->data[s->len - 1] != '"') {
+        error(st, "Expected a string: %.*s", (int)s->len, s->data);
+        return false;
+    }
+    *s = (Str){s->data + 1, s->len - 2};
+    return true;
+}
+
+// For operands that cannot be patched later.
+static Expr
+read_const_expr(State *st)
+{
+    Expr e = read_expr(st);
+    if (!e.known) {
+        Str name = st->symtab.syms[e.sym].name;
+        error(st, "Expected a constant: %.*s", (int)name.len, name.data);
+        e = (Expr){.known = true, .result = 0};
+    }
+    return e;
 }
 
+// The base instruction set, and whether the instructions are emitted in
+// their 16-bit forms where they have one.
+enum Target {
+    TARGET_RV32 = 0,
+    TARGET_RV64 = 1,
+    TARGET_C = 2,  // Added to either of the others.
+};
+typedef enum Target Target;
+
 #include "instructions.c"
 
-#define MAX_OUTPUT_SIZE 4096
+// The output is a list of chunks that are never moved once allocated,
+// so pointers into them stay valid while the image grows.  Each chunk is
+// twice the size of the previous one, up to OUTPUT_MAX_CHUNK, which keeps
+// the list short enough to hand to a single writev even for images of
+// many gigabytes.  A chunk can end with unused space: a 32-bit value that
+// does not fit at the end of a chunk starts the next one instead of
+// straddling the two.
+//
+// The bytes of an .incbin file are a chunk of their own that maps the
+// file, so they are written from the page cache without being copied.
+#define OUTPUT_MIN_CHUNK (64 << 10)
+#define OUTPUT_MAX_CHUNK (64 << 20)
+
+struct Chunk {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t start;  // Output offset of data[0].
+    bool file;       // data maps an .incbin file, and is full.
+};
+typedef struct Chunk Chunk;
+
 struct Output {
-    uint8_t output_data[MAX_OUTPUT_SIZE];
+    Chunk *chunks;
+    size_t n_chunks;
+    size_t cap_chunks;
     size_t output_len;
+
+    // If mapped, the chunks are windows of the file fd instead of memory
+    // of their own, so the image is written in place.  The file is
+    // extended a chunk at a time, and the window of a chunk starts where
+    // the previous chunk's output ends.
+    bool mapped;
+    int fd;
 };
 typedef struct Output Output;
 
-static uint8_t *
-output8(Output *out, uint8_t data)
+#ifndef RVAS_LIBRARY
+// Writes the output to the regular file fd, which must be empty.
+static void
+output_map(Output *out, int fd)
+{
+    out->mapped = true;
+    out->fd = fd;
+}
+#endif
+
+// Maps len bytes of the output file from offset, which need not be on a
+// page boundary.
+static uint8_t *
+output_map_window(const Output *out, uint64_t offset, size_t len)
+{
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t skip = offset % page;
+    int err = posix_fallocate(out->fd, offset, len);
+    void *p = MAP_FAILED;
+    if (!err) {
+        p = mmap(NULL, skip + len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                out->fd, offset - skip);
+        err = errno;
+    }
+    if (p == MAP_FAILED) {
+        print_error("Could not write output: %s\n", strerror(err));
+        exit(1);
+    }
+    return (uint8_t *)p + skip;
+}
+
+static void
+output_unmap_window(uint8_t *data, size_t len)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t skip = (uintptr_t)data % page;
+    munmap(data - skip, skip + len);
+}
+
+static Chunk *
+output_new_chunk(Output *out)
+{
+    size_t cap = OUTPUT_MIN_CHUNK;
+    if (out->n_chunks) {
+        // The chunk of an .incbin can be of any size.
+        cap = out->chunks[out->n_chunks - 1].cap * 2;
+        cap = cap < OUTPUT_MIN_CHUNK ? OUTPUT_MIN_CHUNK
+            : cap > OUTPUT_MAX_CHUNK ? OUTPUT_MAX_CHUNK : cap;
+    }
+    out->chunks = grow(out->chunks, &out->cap_chunks, out->n_chunks + 1,
+            sizeof *out->chunks);
+    Chunk *c = &out->chunks[out->n_chunks++];
+    *c = (Chunk){.cap = cap, .start = out->output_len};
+    if (out->mapped) {
+        c->data = output_map_window(out, c->start, cap);
+    } else if (!(c->data = malloc(cap))) {
+        out_of_memory();
+    }
+    return c;
+}
+
+// Returns room for n contiguous bytes at the end of the output.
+static uint8_t *
+output_reserve(Output *out, size_t n)
+{
+    assert(n <= OUTPUT_MIN_CHUNK);
+    Chunk *c = out->n_chunks ? &out->chunks[out->n_chunks - 1] : NULL;
+    if (!c || c->cap - c->len < n) {
+        c = output_new_chunk(out);
+    }
+    uint8_t *p = c->data + c->len;
+    c->len += n;
+    out->output_len += n;
+    return p;
+}
+
+static void
+output16(Output *out, uint16_t data)
+{
+    uint8_t *p = output_reserve(out, 2);
+    p[0] = data;
+    p[1] = data >> 8;
+}
+
+static uint32_t *
+output32(Output *out, uint32_t data)
+{
+    uint8_t *p = output_reserve(out, 4);
+    p[0] = data;
+    p[1] = data >> 8;
+    p[2] = data >> 16;
+    p[3] = data >> 24;
+    return (uint32_t *)p;
+}
+
+static void
+output_bytes(Output *out, const void *data, size_t len)
+{
+    const uint8_t *src = data;
+    while (len) {
+        Chunk *c = out->n_chunks ? &out->chunks[out->n_chunks - 1] : NULL;
+        if (!c || c->len == c->cap) {
+            c = output_new_chunk(out);
+        }
+        size_t n = c->cap - c->len < len ? c->cap - c->len : len;
+        memcpy(c->data + c->len, src, n);
+        c->len += n;
+        out->output_len += n;
+        src += n;
+        len -= n;
+    }
+}
+
+// Appends len bytes of the value byte.
+static void
+output_fill(Output *out, uint8_t byte, uint64_t len)
+{
+    while (len) {
+        Chunk *c = out->n_chunks ? &out->chunks[out->n_chunks - 1] : NULL;
+        if (!c || c->len == c->cap) {
+            c = output_new_chunk(out);
+        }
+        size_t n = c->cap - c->len < len ? c->cap - c->len : len;
+        memset(c->data + c->len, byte, n);
+        c->len += n;
+        out->output_len += n;
+        len -= n;
+    }
+}
+
+// Copies len bytes of the file fd from offset to the output file at
+// out_offset, in the kernel.
+static bool
+output_copy_file(int fd, uint64_t offset, int out_fd, uint64_t out_offset,
+        uint64_t len)
+{
+    loff_t in = offset;
+    loff_t to = out_offset;
+    while (len) {
+        ssize_t n = copy_file_range(fd, &in, out_fd, &to, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len -= n;
+    }
+    // Older kernels cannot copy between some file systems.
+    while (len) {
+        char buf[1 << 16];
+        ssize_t n = pread(fd, buf, len < sizeof buf ? len : sizeof buf, in);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || pwrite(out_fd, buf, n, to) != n) {
+            return false;
+        }
+        in += n;
+        to += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Appends a chunk that is full, such as that of an .incbin.
+static void
+output_add_chunk(Output *out, Chunk c)
+{
+    out->chunks = grow(out->chunks, &out->cap_chunks, out->n_chunks + 1,
+            sizeof *out->chunks);
+    c.start = out->output_len;
+    out->chunks[out->n_chunks++] = c;
+    out->output_len += c.len;
+}
+
+// Appends len bytes of the file fd from offset, which are copied by the
+// kernel: into a mapped output file, or from a chunk that maps the file
+// when the output is written.  Returns false if the file cannot be read.
+static bool
+output_file(Output *out, int fd, uint64_t offset, uint64_t len)
+{
+    if (!len) {
+        return true;
+    }
+    Chunk c = {.len = len, .cap = len};
+    if (out->mapped) {
+        c.data = output_map_window(out, out->output_len, len);
+        if (!output_copy_file(fd, offset, out->fd, out->output_len, len)) {
+            output_unmap_window(c.data, len);
+            return false;
+        }
+    } else {
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t skip = offset % page;
+        void *p = mmap(NULL, skip + len, PROT_READ, MAP_PRIVATE, fd,
+                offset - skip);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        c.data = (uint8_t *)p + skip;
+        c.file = true;
+    }
+    output_add_chunk(out, c);
+    return true;
+}
+
+// The benchmark writes the image as the program does.
+#if !defined(RVAS_LIBRARY) || defined(RVAS_BENCH)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Writes all chunks with one writev, or a few if there are more chunks
+// than IOV_MAX or the write comes back short.
+static bool
+output_write(const Output *out, int fd)
+{
+    struct iovec iov[IOV_MAX];
+    size_t chunk = 0;
+    size_t done = 0;  // Bytes of out->chunks[chunk] already written.
+    while (chunk < out->n_chunks) {
+        int n_iov = 0;
+        for (size_t k = chunk; k < out->n_chunks && n_iov < IOV_MAX; k++) {
+            size_t skip = k == chunk ? done : 0;
+            iov[n_iov++] = (struct iovec) {
+                out->chunks[k].data + skip,
+                out->chunks[k].len - skip,
+            };
+        }
+        ssize_t n = writev(fd, iov, n_iov);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        size_t left = n;
+        while (chunk < out->n_chunks
+                && left >= out->chunks[chunk].len - done)
+        {
+            left -= out->chunks[chunk].len - done;
+            done = 0;
+            chunk++;
+        }
+        done += left;
+    }
+    return true;
+}
+#endif
+
+// Copies the output to dst, which has room for out->output_len bytes.
+static void
+output_copy(const Output *out, uint8_t *dst)
+{
+    for (size_t i = 0; i < out->n_chunks; i++) {
+        memcpy(dst + out->chunks[i].start, out->chunks[i].data,
+                out->chunks[i].len);
+    }
+}
+
+static void
+output_free_chunk(const Output *out, const Chunk *c)
+{
+    if (out->mapped || c->file) {
+        output_unmap_window(c->data, c->cap);
+    } else {
+        free(c->data);
+    }
+}
+
+static void
+output_free(Output *out)
 {
-    if (out->output_len + 1 > MAX_OUTPUT_SIZE) {
-        abort();
+    for (size_t i = 0; i < out->n_chunks; i++) {
+        output_free_chunk(out, &out->chunks[i]);
     }
-    out->output_data[out->output_len] = data;
-    out->output_len += 1;
-    return &out->output_data[out->output_len - 1];
+    free(out->chunks);
 }
 
-static uint32_t *
-output32(Output *out, uint32_t data)
+#ifndef RVAS_LIBRARY
+// Cuts a mapped output file to the size of the output, and if sync is
+// set, waits for the output to reach the disk.
+static bool
+output_finish(const Output *out, bool sync)
 {
-    if (out->output_len + 4 > MAX_OUTPUT_SIZE) {
-        abort();
+    bool ok = ftruncate(out->fd, out->output_len) == 0;
+    for (size_t i = 0; sync && ok && i < out->n_chunks; i++) {
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uint8_t *data = out->chunks[i].data;
+        uintptr_t skip = (uintptr_t)data % page;
+        ok = msync(data - skip, skip + out->chunks[i].len, MS_SYNC) == 0;
     }
-    out->output_data[out->output_len] = data;
-    out->output_data[out->output_len + 1] = data >> 8;
-    out->output_data[out->output_len + 2] = data >> 16;
-    out->output_data[out->output_len + 3] = data >> 24;
-    out->output_len += 4;
-    return (uint32_t*)&out->output_data[out->output_len - 4];
+    return ok;
 }
+#endif
 
 struct CompiledInstr {
     uint32_t instr;
     bool replace_imm;
 
-    // Only used if replace_imm == true.
-    UnknownValue unknown_value;
+    // Only used if replace_imm == true.  The offset is filled in when the
+    // instruction is emitted.
+    Fixup fixup;
 };
 typedef struct CompiledInstr CompiledInstr;
 
+// Returns the kind of fixup for an expression in an immediate of the
+// kind imm, which is FIXUP_I, FIXUP_S, FIXUP_B, FIXUP_J or FIXUP_HI for a
+// U-type, or in data of a data kind, and reports an error if its
+// relocation does not fit there.
+static FixupKind
+expr_fixup_kind(State *st, const Expr *e, FixupKind imm)
+{
+    Reloc reloc = e->reloc;
+    if (imm == FIXUP_HI) {
+        if (reloc == RELOC_HI || reloc == RELOC_PCREL_HI) {
+            return reloc == RELOC_HI ? FIXUP_HI : FIXUP_PCREL_HI;
+        }
+    } else if (imm == FIXUP_I || imm == FIXUP_S) {
+        if (reloc == RELOC_PCREL_LO) {
+            return imm == FIXUP_I ? FIXUP_PCREL_LO_I : FIXUP_PCREL_LO_S;
+        }
+        if (reloc == RELOC_NONE || reloc == RELOC_LO) {
+            return imm;
+        }
+    } else if (reloc == RELOC_NONE) {
+        if (e->known && !fixup_in_range(imm, e->result)) {
+            error(st, "Branch offset out of range: %lld",
+                    (long long)e->result);
+        }
+        return imm;
+    }
+    if (reloc != RELOC_NONE) {
+        error(st, "Cannot use %%%s here", reloc_names[reloc]);
+    } else if (!e->known) {
+        // A U-type immediate without a relocation.
+        Str name = st->symtab.syms[e->sym].name;
+        error(st, "Expected a constant: %.*s", (int)name.len, name.data);
+    }
+    return imm;
+}
+
 static CompiledInstr
-compile_instr_rrr(State *st, uint32_t (fn)(Reg, Reg, Reg))
+compile_instr_rrr(State *st, const Instr *in)
 {
     Reg rd = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Reg rs1 = read_reg(st);
-    comma = read_token(st);
+    expect(st, ',');
     Reg rs2 = read_reg(st);
     return (CompiledInstr) {
-        .instr = fn(rd, rs1, rs2),
+        .instr = instr_encode_r(in, rd, rs1, rs2),
         .replace_imm = false,
     };
 }
 
 static CompiledInstr
-compile_instr_rri(State *st, uint32_t (fn)(Reg, Reg, int32_t), enum InstrType type)
+compile_instr_rri(State *st, const Instr *in, Target target)
 {
     Reg rd = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Reg rs1 = read_reg(st);
-    comma = read_token(st);
+    expect(st, ',');
     Expr e = read_expr(st);
+    int32_t imm = e.known ? e.result : 0;
+    bool is_branch = in->format == FMT_B;
     return (CompiledInstr) {
-        .instr = fn(rd, rs1, e.known ? e.result : 0),
+        .instr = is_branch
+            ? instr_encode_b(in, rd, rs1, imm)
+            : instr_encode_i(in, target, rd, rs1, imm),
         .replace_imm = !e.known,
-        .unknown_value = {
-            .type = type,
-            .label = e.known ? (Str){} : e.label,
+        .fixup = {
+            .kind = expr_fixup_kind(st, &e, is_branch ? FIXUP_B : FIXUP_I),
+            .sym = e.known ? 0 : e.sym,
         },
     };
 }
 
 static CompiledInstr
-compile_instr_ru(State *st, uint32_t (fn)(Reg, int32_t))
+compile_instr_ru(State *st, const Instr *in)
 {
     Reg rd = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Expr e = read_expr(st);
+    FixupKind kind = expr_fixup_kind(st, &e, FIXUP_HI);
+    bool replace_imm = !e.known && e.reloc != RELOC_NONE;
     return (CompiledInstr) {
-        .instr = fn(rd, e.known ? e.result << 12 : 0),
-        .replace_imm = !e.known,
+        .instr = instr_encode_u(in, rd, e.known ? e.result << 12 : 0),
+        .replace_imm = replace_imm,
+        .fixup = {
+            .kind = kind,
+            .sym = replace_imm ? e.sym : 0,
+        },
     };
 }
 
 static CompiledInstr
-compile_instr_rm(State *st, uint32_t (fn)(Reg, Reg, int32_t))
+compile_instr_rm(State *st, const Instr *in, Target target)
 {
     Reg r1 = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Expr e = read_expr(st);
-    Str par = read_token(st);
+    expect(st, '(');
     Reg r2 = read_reg(st);
-    par = read_token(st);
+    expect(st, ')');
+    int32_t imm = e.known ? e.result : 0;
     return (CompiledInstr) {
-        .instr = fn(r1, r2, e.known ? e.result : 0),
+        .instr = in->format == FMT_STORE
+            ? instr_encode_s(in, r1, r2, imm)
+            : instr_encode_i(in, target, r1, r2, imm),
         .replace_imm = !e.known,
+        .fixup = {
+            .kind = expr_fixup_kind(st, &e,
+                    in->format == FMT_STORE ? FIXUP_S : FIXUP_I),
+            .sym = e.known ? 0 : e.sym,
+        },
     };
 }
 
 static CompiledInstr
-compile_instr_ri(State *st, uint32_t (fn)(Reg, int32_t), enum InstrType type)
+compile_instr_ri(State *st, const Instr *in)
 {
     Reg rd = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Expr e = read_expr(st);
     return (CompiledInstr) {
-        .instr = fn(rd, e.known ? e.result : 0),
+        .instr = instr_encode_j(in, rd, e.known ? e.result : 0),
         .replace_imm = !e.known,
-        .unknown_value = {
-            .type = type,
-            .label = e.known ? (Str){} : e.label,
+        .fixup = {
+            .kind = expr_fixup_kind(st, &e, FIXUP_J),
+            .sym = e.known ? 0 : e.sym,
         },
     };
 }
 
 static CompiledInstr
-compile_instr_csr(State *st, uint32_t (fn)(Reg, Csr, Reg))
+compile_instr_csr(State *st, const Instr *in)
 {
     Reg rd = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Csr csr = read_csr(st);
-    comma = read_token(st);
+    expect(st, ',');
     Reg rs1 = read_reg(st);
     return (CompiledInstr) {
-        .instr = fn(rd, csr, rs1),
+        .instr = instr_encode_csr(in, rd, csr, rs1),
     };
 }
 
 static CompiledInstr
-compile_instr_csri(State *st, uint32_t (fn)(Reg, Csr, int32_t))
+compile_instr_csri(State *st, const Instr *in)
 {
     Reg rd = read_reg(st);
-    Str comma = read_token(st);
+    expect(st, ',');
     Csr csr = read_csr(st);
-    comma = read_token(st);
-    Expr e = read_expr(st);
+    expect(st, ',');
+    Expr e = read_const_expr(st);
     return (CompiledInstr) {
-        .instr = fn(rd, csr, e.known ? e.result : 0),
-        .replace_imm = !e.known,
+        .instr = instr_encode_csri(in, rd, csr, e.result),
     };
 }
 
-enum Target {
-    TARGET_RV32, TARGET_RV64,
-};
-typedef enum Target Target;
+static void
+add_fixup(State *st, Fixup f)
+{
+    st->fixups = grow(st->fixups, &st->cap_fixups, st->n_fixups + 1,
+            sizeof *st->fixups);
+    if (st->stream) {
+        st->fixup_lines = grow(st->fixup_lines, &st->cap_fixup_lines,
+                st->n_fixups + 1, sizeof *st->fixup_lines);
+        st->fixup_lines[st->n_fixups] = st->line;
+    }
+    st->fixups[st->n_fixups++] = f;
+}
 
+// Emits an instruction, and records its fixup if it has one.  The lowest
+// two bits of a 32-bit instruction are set, and those of a 16-bit one are
+// not.
 static void
-compile_inst(Output *out, State *st, Str first, Target target)
+emit_instr(Output *out, State *st, CompiledInstr instr)
 {
-    CompiledInstr instr = {0};
-    if (str_eq(first, str("add"))) {
-        instr = compile_instr_rrr(st, instr_add);
-    } else if (str_eq(first, str("addi"))) {
-        instr = compile_instr_rri(st, instr_addi, INSTR_I);
-    } else if (str_eq(first, str("jal"))) {
-        instr = compile_instr_ri(st, instr_jal, INSTR_J);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("jalr"))) {
-        instr = compile_instr_rm(st, instr_jalr);
-    } else if (str_eq(first, str("sub"))) {
-        instr = compile_instr_rrr(st, instr_sub);
-    } else if (str_eq(first, str("auipc"))) {
-        instr = compile_instr_ru(st, instr_auipc);
-    } else if (str_eq(first, str("lui"))) {
-        instr = compile_instr_ru(st, instr_lui);
-    } else if (str_eq(first, str("and"))) {
-        instr = compile_instr_rrr(st, instr_and);
-    } else if (str_eq(first, str("andi"))) {
-        instr = compile_instr_rri(st, instr_andi, INSTR_I);
-    } else if (str_eq(first, str("or"))) {
-        instr = compile_instr_rrr(st, instr_or);
-    } else if (str_eq(first, str("ori"))) {
-        instr = compile_instr_rri(st, instr_ori, INSTR_I);
-    } else if (str_eq(first, str("beq"))) {
-        instr = compile_instr_rri(st, instr_beq, INSTR_B);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("bge"))) {
-        instr = compile_instr_rri(st, instr_bge, INSTR_B);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("bgeu"))) {
-        instr = compile_instr_rri(st, instr_bgeu, INSTR_B);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("blt"))) {
-        instr = compile_instr_rri(st, instr_blt, INSTR_B);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("bltu"))) {
-        instr = compile_instr_rri(st, instr_bltu, INSTR_B);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("bne"))) {
-        instr = compile_instr_rri(st, instr_bne, INSTR_B);
-        instr.unknown_value.relative_to = st->pc;
-    } else if (str_eq(first, str("lb"))) {
-        instr = compile_instr_rm(st, instr_lb);
-    } else if (str_eq(first, str("lbu"))) {
-        instr = compile_instr_rm(st, instr_lbu);
-    } else if (str_eq(first, str("sb"))) {
-        instr = compile_instr_rm(st, instr_sb);
-    } else if (str_eq(first, str("lw"))) {
-        instr = compile_instr_rm(st, instr_lw);
-    } else if (str_eq(first, str("lwu"))) {
-        instr = compile_instr_rm(st, instr_lwu);
-    } else if (str_eq(first, str("sw"))) {
-        instr = compile_instr_rm(st, instr_sw);
-    } else if (target == TARGET_RV64 && str_eq(first, str("ld"))) {
-        instr = compile_instr_rm(st, instr_ld);
-    } else if (target == TARGET_RV64 && str_eq(first, str("sd"))) {
-        instr = compile_instr_rm(st, instr_sd);
-    } else if (str_eq(first, str("lh"))) {
-        instr = compile_instr_rm(st, instr_lh);
-    } else if (str_eq(first, str("lhu"))) {
-        instr = compile_instr_rm(st, instr_lhu);
-    } else if (str_eq(first, str("sh"))) {
-        instr = compile_instr_rm(st, instr_sh);
-    } else if (target == TARGET_RV64 && str_eq(first, str("addw"))) {
-        instr = compile_instr_rrr(st, instr64_addw);
-    } else if (target == TARGET_RV64 && str_eq(first, str("subw"))) {
-        instr = compile_instr_rrr(st, instr64_subw);
-    } else if (target == TARGET_RV64 && str_eq(first, str("addiw"))) {
-        instr = compile_instr_rri(st, instr64_addiw, INSTR_I);
-    } else if (target == TARGET_RV32 && str_eq(first, str("slli"))) {
-        instr = compile_instr_rri(st, instr32_slli, INSTR_I);
-    } else if (target == TARGET_RV64 && str_eq(first, str("slli"))) {
-        instr = compile_instr_rri(st, instr64_slli, INSTR_I);
-    } else if (target == TARGET_RV32 && str_eq(first, str("srli"))) {
-        instr = compile_instr_rri(st, instr32_srli, INSTR_I);
-    } else if (target == TARGET_RV64 && str_eq(first, str("srli"))) {
-        instr = compile_instr_rri(st, instr64_srli, INSTR_I);
-    } else if (str_eq(first, str("sll"))) {
-        instr = compile_instr_rrr(st, instr_sll);
-    } else if (str_eq(first, str("srl"))) {
-        instr = compile_instr_rrr(st, instr_srl);
-    } else if (target == TARGET_RV64 && str_eq(first, str("sllw"))) {
-        instr = compile_instr_rrr(st, instr64_sllw);
-    } else if (target == TARGET_RV64 && str_eq(first, str("slliw"))) {
-        instr = compile_instr_rri(st, instr64_slliw, INSTR_I);
-    } else if (target == TARGET_RV64 && str_eq(first, str("srlw"))) {
-        instr = compile_instr_rrr(st, instr64_srlw);
-    } else if (target == TARGET_RV64 && str_eq(first, str("srliw"))) {
-        instr = compile_instr_rri(st, instr64_srliw, INSTR_I);
-    } else if (str_eq(first, str("xor"))) {
-        instr = compile_instr_rrr(st, instr_xor);
-    } else if (str_eq(first, str("xori"))) {
-        instr = compile_instr_rri(st, instr_xori, INSTR_I);
-    } else if (str_eq(first, str("slt"))) {
-        instr = compile_instr_rrr(st, instr_slt);
-    } else if (str_eq(first, str("sltu"))) {
-        instr = compile_instr_rrr(st, instr_sltu);
-    } else if (str_eq(first, str("slti"))) {
-        instr = compile_instr_rri(st, instr_slti, INSTR_I);
-    } else if (str_eq(first, str("sltiu"))) {
-        instr = compile_instr_rri(st, instr_sltiu, INSTR_I);
-    } else if (target == TARGET_RV32 && str_eq(first, str("srai"))) {
-        instr = compile_instr_rri(st, instr32_srai, INSTR_I);
-    } else if (target == TARGET_RV64 && str_eq(first, str("srai"))) {
-        instr = compile_instr_rri(st, instr64_srai, INSTR_I);
-    } else if (target == TARGET_RV64 && str_eq(first, str("sraiw"))) {
-        instr = compile_instr_rri(st, instr64_sraiw, INSTR_I);
-    } else if (target == TARGET_RV64 && str_eq(first, str("sraw"))) {
-        instr = compile_instr_rrr(st, instr64_sraw);
-    } else if (str_eq(first, str("sra"))) {
-        instr = compile_instr_rrr(st, instr_sra);
-    } else if (str_eq(first, str("nop"))) {
-        instr = (CompiledInstr){.instr = instr_addi(REG_ZERO, REG_ZERO, 0)};
-    } else if (str_eq(first, str("ecall"))) {
-        instr = (CompiledInstr){.instr = instr_ecall()};
-    } else if (str_eq(first, str("ebreak"))) {
-        instr = (CompiledInstr){.instr = instr_ebreak()};
-    } else if (str_eq(first, str("csrrc"))) {
-        instr = compile_instr_csr(st, instr_csrrc);
-    } else if (str_eq(first, str("csrrci"))) {
-        instr = compile_instr_csri(st, instr_csrrci);
-    } else if (str_eq(first, str("csrrs"))) {
-        instr = compile_instr_csr(st, instr_csrrs);
-    } else if (str_eq(first, str("csrrsi"))) {
-        instr = compile_instr_csri(st, instr_csrrsi);
-    } else if (str_eq(first, str("csrrw"))) {
-        instr = compile_instr_csr(st, instr_csrrw);
-    } else if (str_eq(first, str("csrrwi"))) {
-        instr = compile_instr_csri(st, instr_csrrwi);
-    } else if (str_eq(first, str("wfi"))) {
-        instr = (CompiledInstr){.instr = instr_wfi()};
+    if (instr.replace_imm) {
+        instr.fixup.offset = out->output_len;
+        add_fixup(st, instr.fixup);
+    }
+    if ((instr.instr & 3) != 3) {
+        output16(out, instr.instr);
+        st->pc += 2;
     } else {
-        print_error("Unknown instruction: %.*s\n",
-                (int)first.len, first.data);
+        output32(out, instr.instr);
+        st->pc += 4;
     }
-    assert(instr.instr != 0);
+}
 
-    uint32_t *output_ptr = output32(out, instr.instr);
+#include "compress.c"
+#include "pseudo.c"
+#include "align.c"
+#include "data.c"
 
-    if (instr.replace_imm) {
-        if (st->n_unknowns < MAX_UNKNOWNS) {
-            instr.unknown_value.ptr = output_ptr;
-            st->unknowns[st->n_unknowns] = instr.unknown_value;
-            st->n_unknowns++;
-        } else {
-            abort();
+static void
+compile_inst(Output *out, State *st, const Token *first, Target target)
+{
+    CompiledInstr instr = {0};
+    Str name = tok_str(st, first);
+    uint64_t hash = first->hash;
+    // A c. mnemonic is lexed as the name c, a dot and the rest.
+    const Token *dot = peek_token(st);
+    if (first->kind == TOK_NAME && name.len == 1 && name.data[0] == 'c'
+            && is_punct(st, dot, '.') && dot->start == first->start + 1)
+    {
+        const Token *rest = &st->toks[st->tok + 1];
+        if (rest->kind == TOK_NAME && rest->start == dot->start + 1) {
+            st->tok += 2;
+            name.len = 2 + rest->len;
+            hash = str_hash(name);
         }
     }
+    const Instr *in = first->kind == TOK_NAME
+        ? isa_lookup(name, hash, target)
+        : NULL;
+    if (!in) {
+        error(st, "Unknown instruction: %.*s", (int)name.len, name.data);
+        return;
+    }
+    switch (in->format) {
+    case FMT_R:
+        instr = compile_instr_rrr(st, in);
+        break;
+    case FMT_I:
+    case FMT_SHIFT:
+    case FMT_SHIFTW:
+    case FMT_B:
+        instr = compile_instr_rri(st, in, target);
+        break;
+    case FMT_LOAD:
+    case FMT_STORE:
+        instr = compile_instr_rm(st, in, target);
+        break;
+    case FMT_U:
+        instr = compile_instr_ru(st, in);
+        break;
+    case FMT_J:
+        instr = compile_instr_ri(st, in);
+        break;
+    case FMT_CSR:
+        instr = compile_instr_csr(st, in);
+        break;
+    case FMT_CSRI:
+        instr = compile_instr_csri(st, in);
+        break;
+    case FMT_NONE:
+        instr = (CompiledInstr){.instr = in->match};
+        break;
+    case FMT_C_RR:
+    case FMT_C_MV:
+    case FMT_C_RI:
+    case FMT_C_LI:
+    case FMT_C_JR:
+    case FMT_C_J:
+    case FMT_C_BZ:
+        instr = compile_instr_c(st, in);
+        break;
+    case FMT_LI:
+    case FMT_LA:
+    case FMT_CALL:
+    case FMT_TAIL:
+        compile_pseudo(out, st, in, target);
+        return;
+    }
+    assert(instr.instr != 0);
+    instr = in->compressed ? compress_mnemonic(st, in, instr, target)
+        : compress(instr, target);
+    emit_instr(out, st, instr);
 }
 
-static LabelValue *
-get_label(const State *st, Str label)
+// Gives the symbol its value, or reports that it already has one.
+static void
+define_symbol(State *st, const Token *t, SymKind kind, int64_t value)
 {
-    for (size_t i = 0; i < st->n_labels; i++) {
-        LabelValue *lab = &st->labels[i];
-        if (str_eq(lab->label, label)) {
-            return lab;
+    Str name = tok_str(st, t);
+    if (t->kind != TOK_NAME) {
+        error(st, "Expected a name: %.*s", (int)name.len, name.data);
+        return;
+    }
+    uint64_t pos = tok_pos(st, t);
+    if (st->consts) {
+        // The constants have been defined already, so only check that this
+        // is the definition that was used.
+        const Symbol *c = sym_find(st->consts, name, t->hash);
+        bool is_const = c && c->kind == SYM_CONST;
+        if (kind == SYM_CONST) {
+            const Symbol *local = sym_find(&st->symtab, name, t->hash);
+            if (!is_const || c->pos != pos
+                    || (local && local->kind != SYM_UNDEFINED))
+            {
+                error(st, "Symbol redefined: %.*s", (int)name.len, name.data);
+            }
+            return;
+        }
+        if (is_const && c->pos < pos) {
+            error(st, "Symbol redefined: %.*s", (int)name.len, name.data);
+            return;
         }
     }
-    return NULL;
+    SymId id = sym_intern(&st->symtab, name, t->hash);
+    Symbol *sym = &st->symtab.syms[id];
+    if (sym->kind != SYM_UNDEFINED) {
+        error(st, "Symbol redefined: %.*s", (int)name.len, name.data);
+        return;
+    }
+    sym->kind = kind;
+    sym->value = value;
+    sym->file = st->file;
+    sym->line = st->line;
+    sym->pos = pos;
+    if (st->stream && kind == SYM_LABEL) {
+        st->labels = grow(st->labels, &st->cap_labels, st->n_labels + 1,
+                sizeof *st->labels);
+        st->labels[st->n_labels++] = id;
+    }
+}
+
+// Bits hi to lo of the value go to bit pos of the instruction.
+struct FixupField {
+    uint8_t hi;
+    uint8_t lo;
+    uint8_t pos;
+};
+
+// The immediate fields of each kind of fixup.
+static const struct FixupFormat {
+    int n_fields;
+    struct FixupField fields[8];
+} fixup_formats[N_FIXUP_KINDS] = {
+    [FIXUP_I] = {1, {{11, 0, 20}}},
+    [FIXUP_S] = {2, {{11, 5, 25}, {4, 0, 7}}},
+    [FIXUP_J] = {4, {{20, 20, 31}, {10, 1, 21}, {11, 11, 20}, {19, 12, 12}}},
+    [FIXUP_B] = {4, {{12, 12, 31}, {10, 5, 25}, {4, 1, 8}, {11, 11, 7}}},
+    [FIXUP_HI] = {1, {{31, 12, 12}}},
+    [FIXUP_PCREL_HI] = {1, {{31, 12, 12}}},
+    [FIXUP_PAIR_LO] = {1, {{11, 0, 20}}},
+    [FIXUP_PCREL_LO_I] = {1, {{11, 0, 20}}},
+    [FIXUP_PCREL_LO_S] = {2, {{11, 5, 25}, {4, 0, 7}}},
+    [FIXUP_CB] = {5, {{8, 8, 12}, {4, 3, 10}, {7, 6, 5}, {2, 1, 3}, {5, 5, 2}}},
+    [FIXUP_CJ] = {8, {{11, 11, 12}, {4, 4, 11}, {9, 8, 9}, {10, 10, 8},
+        {6, 6, 7}, {7, 7, 6}, {3, 1, 3}, {5, 5, 2}}},
+    // A field is at most 16 bits wide, and the upper half of a .dword is
+    // filled in on its own.
+    [FIXUP_DATA16] = {1, {{15, 0, 0}}},
+    [FIXUP_DATA32] = {2, {{31, 16, 16}, {15, 0, 0}}},
+    [FIXUP_DATA64] = {2, {{31, 16, 16}, {15, 0, 0}}},
+};
+
+#ifndef RVAS_LIBRARY
+// Whether the value of a fixup depends on where its instruction is.
+static bool
+fixup_is_relative(FixupKind kind)
+{
+    return kind == FIXUP_J || kind == FIXUP_B || kind == FIXUP_PCREL_HI
+        || kind == FIXUP_PAIR_LO || kind == FIXUP_CB || kind == FIXUP_CJ;
+}
+#endif
+
+// Returns the value that the immediate of a fixup takes its bits from,
+// given the value of its symbol.  For %pcrel_lo, value must instead be the
+// offset that the auipc at the label adds.
+static int64_t
+fixup_value(const Fixup *f, int64_t value)
+{
+    switch (f->kind) {
+    case FIXUP_J:
+    case FIXUP_B:
+    case FIXUP_CB:
+    case FIXUP_CJ:
+        return value - f->offset;
+    case FIXUP_HI:
+        // The lower 12 bits are sign-extended when they are added, so
+        // round the upper part to make up for it.
+        return value + 0x800;
+    case FIXUP_PCREL_HI:
+        return value - f->offset + 0x800;
+    case FIXUP_PAIR_LO:
+        return value - (f->offset - 4);
+    default:
+        return value;
+    }
+}
+
+static uint32_t
+fixup_bits(FixupKind kind, int64_t value)
+{
+    const struct FixupFormat *fmt = &fixup_formats[kind];
+    uint32_t patch = 0;
+    for (int k = 0; k < fmt->n_fields; k++) {
+        const struct FixupField *f = &fmt->fields[k];
+        patch |= bits(value, f->hi, f->lo) << f->pos;
+    }
+    return patch;
 }
 
+// ORs patch, the bits of a fixup of the kind, into the instruction or
+// data at p.
 static void
-compile(const char *code, size_t code_size, Target target)
+fixup_or(uint8_t *p, FixupKind kind, uint64_t patch)
 {
-    Output out = {0};
-    State st = {
-        .code = {code, code_size},
-        .i = 0,
-    };
+    int size = fixup_size(kind);
+    p[0] |= patch;
+    p[1] |= patch >> 8;
+    if (size > 2) {
+        p[2] |= patch >> 16;
+        p[3] |= patch >> 24;
+    }
+    if (size > 4) {
+        p[4] |= patch >> 32;
+        p[5] |= patch >> 40;
+        p[6] |= patch >> 48;
+        p[7] |= patch >> 56;
+    }
+}
 
-    for (;;) {
-        Str first = read_token(&st);
-        if (first.len == 0) {
-            // Nothing more to read.
-            break;
+#ifndef RVAS_LIBRARY
+// Like fixup_bits, but with the upper half of a .dword too.
+static uint64_t
+fixup_bits64(FixupKind kind, int64_t value)
+{
+    uint64_t patch = fixup_bits(kind, value);
+    if (kind == FIXUP_DATA64) {
+        patch |= (uint64_t)value >> 32 << 32;
+    }
+    return patch;
+}
+
+// ORs the bits of a fixup with the given value into the instruction or
+// data at p.
+static void
+fixup_apply(uint8_t *p, FixupKind kind, int64_t value)
+{
+    fixup_or(p, kind, fixup_bits64(kind, value));
+}
+#endif
+
+#include "fixup.c"
+#include "relax.c"
+
+// Returns the %pcrel_hi fixup at offset, or NULL.
+static const Fixup *
+find_pcrel_hi(const Fixup *fixups, size_t n_fixups, uint64_t offset)
+{
+    // The fixups are in output order.
+    size_t lo = 0;
+    size_t hi = n_fixups;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fixups[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        if (first.len && first.data[0] == '\n') {
-            // End of line. Read next instruction.
+    }
+    if (lo < n_fixups && fixups[lo].offset == offset
+            && fixups[lo].kind == FIXUP_PCREL_HI)
+    {
+        return &fixups[lo];
+    }
+    return NULL;
+}
+
+// Returns the value of a %pcrel_lo of label: the offset that the auipc at
+// the label adds, or 0 if it is not known.
+static int64_t
+pcrel_lo_value(State *st, const Symbol *label)
+{
+    if (label->kind == SYM_UNDEFINED) {
+        return 0;
+    }
+    const Fixup *hi = label->kind == SYM_LABEL
+        ? find_pcrel_hi(st->fixups, st->n_fixups, label->value) : NULL;
+    if (!hi) {
+        error_at(st, label->file, label->line, "No %%pcrel_hi at label: %.*s",
+                (int)label->name.len, label->name.data);
+        return 0;
+    }
+    const Symbol *sym = &st->symtab.syms[hi->sym];
+    return sym->kind == SYM_UNDEFINED ? 0 : sym->value - label->value;
+}
+
+// Reports the branches among the fixups that do not reach a symbol that
+// is not a label, and the c. branches that do not reach.  Returns whether
+// some other branches do not reach a label, which relaxation can fix.
+static bool
+far_branches(State *st, const Fixup *fixups, size_t n)
+{
+    bool labels = false;
+    for (size_t i = 0; i < n; i++) {
+        const Fixup *f = &fixups[i];
+        const Symbol *sym = &st->symtab.syms[f->sym];
+        if (f->kind == FIXUP_PCREL_LO_I || f->kind == FIXUP_PCREL_LO_S
+                || sym->kind == SYM_UNDEFINED
+                || fixup_in_range(f->kind, fixup_value(f, sym->value)))
+        {
             continue;
         }
-        State st_tmp = st;
-        Str second = read_token(&st_tmp);
-        if (str_eq(second, str(":"))) {
-            st = st_tmp;
-            if (st.n_labels >= ARR_SIZE(st.labels)) {
-                print_error("Too many labels");
-                break;
+        if (sym->kind == SYM_LABEL && !fixup_is_short(f->kind)) {
+            labels = true;
+        } else {
+            error_at(st, 0, 0, "Branch out of range: %.*s",
+                    (int)sym->name.len, sym->name.data);
+        }
+    }
+    return labels;
+}
+
+// Fixups are resolved this many at a time, so their values stay in the
+// first level cache between the passes.
+#define RESOLVE_BLOCK 1024
+
+// Fills in the values that were unknown when their instructions were
+// emitted, a block of fixups at a time.  The values of the symbols are
+// gathered into an array per kind of fixup, each array is encoded all at
+// once, and the encodings are then ORed into place.  Fixups are recorded
+// in output order, so their places are found by walking the fixups and
+// the output chunks side by side, front to back.
+//
+// Stops at the first block with a branch that does not reach its label,
+// before filling it in, and returns how many fixups were.
+static size_t
+resolve_fixups(State *st, Output *out)
+{
+    uint32_t values[RESOLVE_BLOCK];
+    size_t chunk = 0;
+    for (size_t base = 0; base < st->n_fixups; base += RESOLVE_BLOCK) {
+        const Fixup *fixups = st->fixups + base;
+        size_t n = st->n_fixups - base < RESOLVE_BLOCK
+            ? st->n_fixups - base : RESOLVE_BLOCK;
+        size_t start[N_FIXUP_KINDS + 1] = {0};
+        for (size_t i = 0; i < n; i++) {
+            start[fixups[i].kind + 1]++;
+        }
+        for (int k = 0; k < N_FIXUP_KINDS; k++) {
+            start[k + 1] += start[k];
+        }
+
+        size_t next[N_FIXUP_KINDS];
+        memcpy(next, start, sizeof next);
+        bool far = false;
+        for (size_t i = 0; i < n; i++) {
+            const Fixup *f = &fixups[i];
+            const Symbol *sym = &st->symtab.syms[f->sym];
+            // Zero encodes to nothing, which leaves the instruction alone.
+            int64_t value = 0;
+            if (f->kind == FIXUP_PCREL_LO_I || f->kind == FIXUP_PCREL_LO_S) {
+                value = pcrel_lo_value(st, sym);
+            } else if (sym->kind != SYM_UNDEFINED) {
+                value = fixup_value(f, sym->value);
+                far |= !fixup_in_range(f->kind, value);
             }
-            st.labels[st.n_labels] = (LabelValue) {
-                .label = first,
-                .value = st.pc,
-            };
-            st.n_labels++;
-        } else if (str_eq(first, str("."))) {
-            st = st_tmp;
-            if (str_eq(second, str("equ"))) {
-                Str name = read_token(&st);
-                Str comma = read_token(&st);
-                Expr e = read_expr(&st);
-                if (st.n_consts < MAX_CONSTS) {
-                    if (!e.known) {
-                        print_error("Constant must not be label");
-                        abort();
-                    }
-                    st.consts[st.n_consts] = (Const) {
-                        .name = name,
-                        .num = e.result,
-                    };
-                    st.n_consts++;
-                } else {
-                    abort();
-                }
-            } else if (str_eq(second, str("db"))) {
-                Str arg = read_token(&st);
-                if (arg.len >= 2 && arg.data[0] == '"') {
-                    arg.len -= 2;
-                    arg.data += 1;
-                }
-                for (size_t i = 0; i < arg.len; i++) {
-                    output8(&out, arg.data[i]);
+            values[next[f->kind]++] = value;
+        }
+        if (far && far_branches(st, fixups, n)) {
+            return base;
+        }
+        for (int kind = 0; kind < N_FIXUP_KINDS; kind++) {
+            fixup_bits_all(kind, values + start[kind],
+                    start[kind + 1] - start[kind]);
+        }
+
+        memcpy(next, start, sizeof next);
+        for (size_t i = 0; i < n; i++) {
+            const Fixup *f = &fixups[i];
+            uint32_t patch = values[next[f->kind]++];
+            while (f->offset
+                    >= out->chunks[chunk].start + out->chunks[chunk].len)
+            {
+                chunk++;
+            }
+            uint8_t *p = out->chunks[chunk].data
+                + (f->offset - out->chunks[chunk].start);
+            uint64_t hi = 0;
+            if (f->kind == FIXUP_DATA64) {
+                // The values only hold the lower half.
+                const Symbol *sym = &st->symtab.syms[f->sym];
+                if (sym->kind != SYM_UNDEFINED) {
+                    hi = (uint64_t)sym->value >> 32;
                 }
-                st.pc += arg.len;
             }
+            fixup_or(p, f->kind, hi << 32 | patch);
+        }
+    }
+
+    // Every symbol is used where it is added, so the ones that are still
+    // undefined are the ones that could not be resolved.
+    for (size_t i = 0; i < st->symtab.n_syms; i++) {
+        const Symbol *sym = &st->symtab.syms[i];
+        if (sym->kind == SYM_UNDEFINED) {
+            error_at(st, 0, 0, "Undefined symbol: %.*s",
+                    (int)sym->name.len, sym->name.data);
+        }
+    }
+    return st->n_fixups;
+}
+
+// Resolves the fixups, making the branches that do not reach longer first
+// if there are any, and the ones that reach in 16 bits shorter if the
+// target has the C extension, and padding the alignments that need it
+// again.  Fills r as relax_branches does.
+static void
+relax_and_resolve(State *st, Output *out, Target target, Relax *r)
+{
+    *r = (Relax){0};
+    size_t resolved = 0;
+    if (!(target & TARGET_C) && !align_misplaced(st)) {
+        size_t n_errors = st->n_errors;
+        resolved = resolve_fixups(st, out);
+        if (resolved == st->n_fixups) {
+            return;
+        }
+        // The fixups are all resolved again, and report their errors
+        // again.
+        for (size_t i = n_errors; i < st->n_errors; i++) {
+            free(st->diags[i].msg);
+        }
+        st->n_errors = n_errors;
+    }
+    relax_branches(st, out, target, r, resolved);
+    resolve_fixups(st, out);
+}
+
+static void
+compile_directive(Output *out, State *st, Target target)
+{
+    const Token *t = read_token(st);
+    Str name = tok_str(st, t);
+    if (str_eq(name, str("equ"))) {
+        const Token *sym = read_token(st);
+        expect(st, ',');
+        Expr e = read_expr(st);
+        if (!e.known) {
+            error(st, "Constant must not be label");
         } else {
-            compile_inst(&out, &st, first, target);
-            st.pc += 4;
+            define_symbol(st, sym, SYM_CONST, e.result);
         }
+    } else if (str_eq(name, str("db"))) {
+        Str s;
+        if (read_string(st, &s)) {
+            output_bytes(out, s.data, s.len);
+            st->pc += s.len;
+        }
+    } else if (str_eq(name, str("align")) || str_eq(name, str("p2align"))
+            || str_eq(name, str("balign")))
+    {
+        compile_align(out, st, t, name.data[0] != 'b', target);
+    } else if (str_eq(name, str("half"))) {
+        compile_data(out, st, FIXUP_DATA16);
+    } else if (str_eq(name, str("word"))) {
+        compile_data(out, st, FIXUP_DATA32);
+    } else if (str_eq(name, str("dword"))) {
+        compile_data(out, st, FIXUP_DATA64);
+    } else if (str_eq(name, str("zero")) || str_eq(name, str("fill"))) {
+        compile_fill(out, st, name.data[0] == 'z');
+    } else if (str_eq(name, str("incbin"))) {
+        compile_incbin(out, st);
+    } else {
+        error(st, "Unknown directive: %.*s", (int)name.len, name.data);
     }
+}
 
-    // Fill in the unknown (but now known) values.
-    for (size_t i = 0; i < st.n_unknowns; i++) {
-        UnknownValue *ukv = &st.unknowns[i];
-        int64_t diff = (int64_t)get_label(&st, ukv->label)->value
-            - ukv->relative_to;
-        switch (ukv->type) {
-        case INSTR_I:
-            *ukv->ptr |= bits(diff, 11, 0) << 20;
-            break;
-        case INSTR_J:
-            *ukv->ptr |= bits(diff, 20, 20) << 31
-                | bits(diff, 10, 1) << 21
-                | bits(diff, 11, 11) << 20
-                | bits(diff, 19, 12) << 12;
-            break;
-        case INSTR_B:
-            *ukv->ptr |= bits(diff, 12, 12) << 31
-                | bits(diff, 10, 5) << 25
-                | bits(diff, 4, 1) << 8
-                | bits(diff, 11, 11) << 7;
-            break;
+// A line is any number of statements: labels, directives and
+// instructions.
+static void
+compile_line(Output *out, State *st, Target target)
+{
+    while (peek_token(st)->kind != TOK_END) {
+        size_t n_errors = st->n_errors;
+        const Token *first = read_token(st);
+        if (is_punct(st, peek_token(st), ':')) {
+            read_token(st);
+            define_symbol(st, first, SYM_LABEL, st->pc);
+        } else if (is_punct(st, first, '.')) {
+            compile_directive(out, st, target);
+        } else {
+            compile_inst(out, st, first, target);
+        }
+        if (st->n_errors != n_errors) {
+            // Skip the rest of the line, so it is reported once.
+            st->tok = st->n_toks - 1;
         }
     }
+}
 
-    write(1, out.output_data, out.output_len * sizeof *out.output_data);
+// Assembles the lines of the code from st->i on.
+static void
+assemble(State *st, Output *out, Target target)
+{
+    while (lex_line(st)) {
+        compile_line(out, st, target);
+    }
 }
 
-int
-main(int argc, char **argv)
+// Frees everything but the errors.
+static void
+state_free(State *st)
 {
-    Target target = TARGET_RV64;
-    if (argc != 2) {
-        fprintf(stderr, "Usage: rvas input-file\n");
-        return 1;
+    symtab_free(&st->symtab);
+    free(st->fixups);
+    free(st->aligns);
+    free(st->toks);
+    free(st->fixup_lines);
+    free(st->labels);
+}
+
+#include "librvas.c"
+
+#ifndef RVAS_LIBRARY
+
+#include "parallel.c"
+
+#include "server.c"
+#include "stats.c"
+
+// Where compile writes the image.
+struct OutputFile {
+    int fd;
+    bool map;   // Write the image in place through a mapping of fd.
+    bool sync;  // Wait for a mapped image to reach the disk.
+};
+typedef struct OutputFile OutputFile;
+
+// Assembles the files into one image and writes it to dest, and to
+// cache_fd unless it is -1.  *cache_ok tells if the second write worked.
+// The phases are measured in stats unless it is NULL.
+static bool
+compile(const Source *sources, size_t n_sources, Target target,
+        int n_threads, const OutputFile *dest, int cache_fd, bool *cache_ok,
+        Stats *stats)
+{
+    Output out = {0};
+    State st = {0};
+    if (!compile_parallel(&st, &out, sources, n_sources, target,
+                n_threads))
+    {
+        // The chunks of a parallel assembly are in memory anyway, so only
+        // a sequential one is worth writing in place.
+        if (dest->map) {
+            output_map(&out, dest->fd);
+        }
+        Str code = sources[0].code;
+        st = (State) {
+            .code = code,
+            .i = 0,
+            .scanner = scanner(code),
+        };
+        assemble(&st, &out, target);
     }
-    char *filename = argv[1];
+    stats_next_phase(stats);
+
+    Relax relax;
+    relax_and_resolve(&st, &out, target, &relax);
+    relax_free(&relax);
+    stats_next_phase(stats);
+    stats_count(stats, &st, &out);
+
+    state_free(&st);
+    bool ok = st.n_errors == 0;
+    print_diags(&st, sources, n_sources);
+    *cache_ok = ok && !st.incbin && cache_fd != -1
+        && output_write(&out, cache_fd);
+    // Relaxation can have moved a mapped output to memory, leaving the
+    // file longer than the image.
+    if (ok && !(out.mapped ? output_finish(&out, dest->sync)
+                : output_write(&out, dest->fd)
+                && (!dest->map || ftruncate(dest->fd, out.output_len) == 0)))
+    {
+        print_error("Could not write output.\n");
+        ok = false;
+    }
+    stats_next_phase(stats);
+    output_free(&out);
+    return ok;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: rvas [-j threads] [-o file] input-file...\n"
+            "       rvas [-o file] - < input-file\n"
+            "       rvas [-j threads] [--max-source size] --serve "
+            "socket-path\n"
+            "       rvas [-j threads] --batch list-file --out-dir dir\n"
+            "       rvas --watch image-file input-file\n"
+            "       rvas --cache-dir dir --cache-trim size\n"
+            "Options: --cache-dir dir  reuse the images of earlier runs\n"
+            "         --stats[=json]   time the phases and count the lines\n"
+            "         --sync           wait until the -o file is on disk\n"
+            "         --compress       use 16-bit forms where they fit\n");
+}
+
+// Maps the file into memory.  Returns false if it cannot be read.
+static bool
+map_file(const char *filename, Str *code)
+{
     int fd = open(filename, O_RDONLY);
     if (fd == -1) {
-        fprintf(stderr, "Could not open file.\n");
-        return 1;
+        fprintf(stderr, "Could not open file: %s\n", filename);
+        return false;
     }
     off_t size = lseek(fd, 0, SEEK_END);
     int prot = PROT_READ;
     int flags = MAP_PRIVATE;
-    void *data = mmap(0, size, prot, flags, fd, 0);
-    if (!data) {
-        fprintf(stderr, "Could not read file.\n");
+    void *data = size ? mmap(0, size, prot, flags, fd, 0) : "";
+    close(fd);
+    if (size < 0 || data == MAP_FAILED) {
+        fprintf(stderr, "Could not read file: %s\n", filename);
+        return false;
+    }
+    *code = (Str){data, size};
+    return true;
+}
+
+// Reads standard input, if the name is "-", or a file that cannot be
+// mapped, such as a pipe, to its end.  Other files are mapped.
+static bool
+read_file(const char *filename, Str *code)
+{
+    bool is_stdin = !strcmp(filename, "-");
+    int fd = is_stdin ? 0 : open(filename, O_RDONLY);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) != 0) {
+        fprintf(stderr, "Could not open file: %s\n", filename);
+        if (fd > 0) {
+            close(fd);
+        }
+        return false;
+    }
+    if (!is_stdin && S_ISREG(sb.st_mode)) {
+        close(fd);
+        return map_file(filename, code);
+    }
+    char *data = NULL;
+    size_t cap = 0;
+    size_t len = 0;
+    bool ok = true;
+    for (;;) {
+        data = grow(data, &cap, len + 65536, 1);
+        ssize_t n = read(fd, data + len, cap - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        len += n;
+    }
+    if (!is_stdin) {
+        close(fd);
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not read file: %s\n", filename);
+        free(data);
+        return false;
+    }
+    *code = (Str){data, len};
+    return true;
+}
+
+#include "cache.c"
+#include "batch.c"
+#include "watch.c"
+#include "stream.c"
+
+// Assembles the input files, or standard input if the name is "-", into
+// one image.  Standard input and pipes are streamed if they are the only
+// input and there is no cache or --stats, and read whole first if not.
+static bool
+compile_inputs(char **names, size_t n_names, Target target, int n_threads,
+        const char *cache_dir, const char *stats_format,
+        const OutputFile *dest)
+{
+    if (n_names == 1 && !cache_dir && !stats_format) {
+        // A pipe cannot be mapped, so it is assembled as it is read, and
+        // so is standard input.
+        const char *name = names[0];
+        bool is_stdin = !strcmp(name, "-");
+        int fd = is_stdin ? 0 : open(name, O_RDONLY);
+        struct stat sb;
+        if (fd != -1 && (is_stdin
+                    || (fstat(fd, &sb) == 0 && !S_ISREG(sb.st_mode))))
+        {
+            return stream(fd, name, target, dest->fd);
+        }
+        if (fd > 0) {
+            close(fd);
+        }
+    }
+    Stats stats_buf;
+    Stats *stats = NULL;
+    if (stats_format) {
+        stats = &stats_buf;
+        stats_init(stats, !strcmp(stats_format, "json"));
+    }
+    size_t n_sources = n_names;
+    Source *sources = calloc(n_sources, sizeof *sources);
+    if (!sources) {
+        print_error("Out of memory\n");
+        return false;
+    }
+    for (size_t i = 0; i < n_sources; i++) {
+        sources[i].name = names[i];
+        if (!read_file(sources[i].name, &sources[i].code)) {
+            return false;
+        }
+    }
+    stats_next_phase(stats);
+    bool ok;
+    if (!cache_dir) {
+        bool cache_ok;
+        ok = compile(sources, n_sources, target, n_threads, dest, -1,
+                &cache_ok, stats);
+    } else {
+        CacheKey key = cache_key(sources, n_sources, target);
+        uint64_t len;
+        CacheLookup found = cache_lookup(cache_dir, key, dest->fd, &len);
+        if (found == CACHE_WRITE_FAILED) {
+            print_error("Could not write output.\n");
+            ok = false;
+        } else if (found == CACHE_HIT) {
+            ok = true;
+            if (stats) {
+                stats->cached = true;
+                stats->bytes = len;
+                stats->phase = STATS_WRITE;
+                stats_next_phase(stats);
+            }
+        } else {
+            char *tmp_path;
+            int cache_fd = cache_insert_begin(cache_dir, key, &tmp_path);
+            bool cache_ok;
+            ok = compile(sources, n_sources, target, n_threads, dest,
+                    cache_fd,
+                    &cache_ok, stats);
+            cache_insert_end(cache_dir, key, cache_fd, tmp_path, cache_ok);
+        }
+    }
+    if (stats) {
+        stats_print(stats, stderr);
+    }
+    return ok;
+}
+
+// Values of the options that only have a long name.
+enum {
+    OPT_SERVE = 256,
+    OPT_BATCH,
+    OPT_OUT_DIR,
+    OPT_CACHE_DIR,
+    OPT_CACHE_TRIM,
+    OPT_WATCH,
+    OPT_STATS,
+    OPT_SYNC,
+    OPT_COMPRESS,
+    OPT_MAX_SOURCE,
+};
+
+int
+main(int argc, char **argv)
+{
+    Target target = TARGET_RV64;
+    int n_threads = 0;
+    const char *socket_path = NULL;
+    const char *batch_list = NULL;
+    const char *out_dir = NULL;
+    const char *cache_dir = NULL;
+    const char *cache_trim_size = NULL;
+    const char *watch_output = NULL;
+    const char *stats_format = NULL;
+    const char *output_path = NULL;
+    const char *max_source = NULL;
+    bool sync = false;
+    isa_init();
+    names_init();
+    static const struct option options[] = {
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"batch", required_argument, NULL, OPT_BATCH},
+        {"out-dir", required_argument, NULL, OPT_OUT_DIR},
+        {"cache-dir", required_argument, NULL, OPT_CACHE_DIR},
+        {"cache-trim", required_argument, NULL, OPT_CACHE_TRIM},
+        {"watch", required_argument, NULL, OPT_WATCH},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"sync", no_argument, NULL, OPT_SYNC},
+        {"compress", no_argument, NULL, OPT_COMPRESS},
+        {"max-source", required_argument, NULL, OPT_MAX_SOURCE},
+        {0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:o:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            n_threads = atoi(optarg);
+            break;
+        case OPT_SERVE:
+            socket_path = optarg;
+            break;
+        case OPT_BATCH:
+            batch_list = optarg;
+            break;
+        case OPT_OUT_DIR:
+            out_dir = optarg;
+            break;
+        case OPT_CACHE_DIR:
+            cache_dir = optarg;
+            break;
+        case OPT_CACHE_TRIM:
+            cache_trim_size = optarg;
+            break;
+        case OPT_WATCH:
+            watch_output = optarg;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case OPT_STATS:
+            stats_format = optarg ? optarg : "text";
+            break;
+        case OPT_SYNC:
+            sync = true;
+            break;
+        case OPT_COMPRESS:
+            target |= TARGET_C;
+            break;
+        case OPT_MAX_SOURCE:
+            max_source = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (n_threads <= 0) {
+        n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (cache_trim_size) {
+        uint64_t max_size;
+        if (!cache_dir || optind != argc
+                || !parse_size(cache_trim_size, &max_size))
+        {
+            usage();
+            return 1;
+        }
+        return cache_trim(cache_dir, max_size) ? 0 : 1;
+    }
+    if (watch_output) {
+        if (argc - optind != 1) {
+            usage();
+            return 1;
+        }
+        return watch(argv[optind], watch_output, target) ? 0 : 1;
+    }
+    if (socket_path) {
+        uint64_t max_size = SERVER_MAX_SOURCE;
+        if (optind != argc
+                || (max_source && !parse_size(max_source, &max_size)))
+        {
+            usage();
+            return 1;
+        }
+        return serve(socket_path, n_threads, max_size) ? 0 : 1;
+    }
+    if (batch_list) {
+        if (optind != argc || !out_dir) {
+            usage();
+            return 1;
+        }
+        return batch(batch_list, out_dir, target, n_threads) ? 0 : 1;
+    }
+    if (optind == argc || (stats_format && strcmp(stats_format, "text")
+                && strcmp(stats_format, "json")))
+    {
+        usage();
         return 1;
     }
-    compile((char *)data, size, target);
+    OutputFile dest = {.fd = 1, .sync = sync};
+    if (output_path) {
+        dest.fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        struct stat sb;
+        if (dest.fd == -1 || fstat(dest.fd, &sb) == -1) {
+            fprintf(stderr, "Could not open file: %s\n", output_path);
+            return 1;
+        }
+        dest.map = S_ISREG(sb.st_mode);
+    }
+    bool ok = compile_inputs(argv + optind, argc - optind, target,
+            n_threads, cache_dir, stats_format, &dest);
+    if (ok && output_path && sync && fsync(dest.fd) == -1) {
+        print_error("Could not write output.\n");
+        ok = false;
+    }
+    if (!ok && dest.map) {
+        unlink(output_path);
+    }
+    return ok ? 0 : 1;
 }
+
+#endif
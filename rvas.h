@@ -0,0 +1,65 @@
+// The assembler as a library.
+//
+// Build it with:
+//
+//     cc -O2 -c -DRVAS_LIBRARY rvas.c -o librvas.o
+//
+// A context holds the tables of the assembler and can assemble any number
+// of sources, one after the other.  Its memory is kept between the calls,
+// so after the first few of them assembling a small source does not
+// allocate.  A context must only be used by one thread at a time; several
+// contexts can be used on several threads.
+
+#ifndef RVAS_H
+#define RVAS_H
+
+#include <stddef.h>
+
+typedef struct Rvas Rvas;
+
+enum RvasTarget {
+    RVAS_RV32,
+    RVAS_RV64,
+    // The same with the C extension: every instruction that has a 16-bit
+    // form is emitted in it.
+    RVAS_RV32C,
+    RVAS_RV64C,
+};
+
+struct RvasDiag {
+    size_t line;  // 0 if the error is not about a line.
+    const char *msg;
+};
+typedef struct RvasDiag RvasDiag;
+
+struct RvasOutput {
+    const unsigned char *data;
+    size_t len;
+};
+typedef struct RvasOutput RvasOutput;
+
+// Returns a new context, or NULL if there is not enough memory.
+Rvas *rvas_new(void);
+
+void rvas_free(Rvas *ctx);
+
+// Sets the target of the next sources.  The default is RVAS_RV64.
+void rvas_set_target(Rvas *ctx, enum RvasTarget target);
+
+// Allows .incbin in the next sources if allow is not 0.  It reads any
+// file the program can read, so it is not allowed by default, and is an
+// error then.
+void rvas_allow_incbin(Rvas *ctx, int allow);
+
+// Assembles len bytes of source code into a raw image.  Returns 0 and
+// points out at the image on success.  Returns -1 if the source has
+// errors, which rvas_diags then returns, or if the memory ran out.  The
+// image and the errors belong to the context and are valid until the
+// next call.
+int rvas_assemble(Rvas *ctx, const char *src, size_t len, RvasOutput *out);
+
+// Returns the errors of the last call to rvas_assemble, in line order,
+// and stores their number in *n.
+const RvasDiag *rvas_diags(const Rvas *ctx, size_t *n);
+
+#endif
@@ -0,0 +1,200 @@
+// Scanning for the ends of runs of whitespace, name characters and number
+// characters, and for the end of the line.  This is where the lexer
+// spends its time on big inputs, so the code is classified a block of
+// 64 bytes at a time: SSE2 (16 bytes per step) or AVX2 (32 bytes per
+// step) turns the block into one bit mask per character class, and every
+// run in the block is then skipped with a bit scan instead of a loop over
+// its characters.  Comments and blank runs are skipped the same way by
+// scanning for the newline.
+//
+// The scalar loops handle the last bytes of the input, and all of it when
+// there is no vector unit or RVAS_SCALAR_LEXER is defined.  Both paths
+// always give the same result.
+
+enum CharClass {
+    CLASS_SPACE,    // is_whitespace
+    CLASS_NAME,     // is_labelchar
+    CLASS_NUMBER,   // is_digit or is_letter
+    CLASS_NEWLINE,
+    N_CLASSES,
+};
+typedef enum CharClass CharClass;
+
+static inline bool
+in_class(char c, CharClass cls)
+{
+    switch (cls) {
+    case CLASS_SPACE:
+        return is_whitespace(c);
+    case CLASS_NAME:
+        return is_labelchar(c);
+    case CLASS_NUMBER:
+        return is_digit(c) || is_letter(c);
+    case CLASS_NEWLINE:
+        return c == '\n';
+    default:
+        return false;
+    }
+}
+
+struct Scanner {
+    const char *s;
+    size_t len;
+    size_t block;  // Offset of the classified block, or SIZE_MAX.
+    uint64_t mask[N_CLASSES];
+};
+typedef struct Scanner Scanner;
+
+static Scanner
+scanner(Str code)
+{
+    return (Scanner){.s = code.data, .len = code.len, .block = SIZE_MAX};
+}
+
+#if !defined(RVAS_SCALAR_LEXER) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_VECTOR 32
+
+// Unsigned lo <= v < lo + n, with signed compares.
+static __m256i
+scan_in_range(__m256i v, char lo, char n)
+{
+    __m256i x = _mm256_add_epi8(_mm256_sub_epi8(v, _mm256_set1_epi8(lo)),
+            _mm256_set1_epi8(-128));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8(n - 128), x);
+}
+
+static void
+scan_classify(const char *p, uint32_t mask[N_CLASSES])
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i space = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alnum = _mm256_or_si256(scan_in_range(lower, 'a', 26),
+            scan_in_range(v, '0', 10));
+    __m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    __m256i newline = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+    mask[CLASS_SPACE] = _mm256_movemask_epi8(space);
+    mask[CLASS_NAME] = _mm256_movemask_epi8(_mm256_or_si256(alnum, under));
+    mask[CLASS_NUMBER] = _mm256_movemask_epi8(alnum);
+    mask[CLASS_NEWLINE] = _mm256_movemask_epi8(newline);
+}
+
+#elif !defined(RVAS_SCALAR_LEXER) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_VECTOR 16
+
+// Unsigned lo <= v < lo + n, with signed compares.
+static __m128i
+scan_in_range(__m128i v, char lo, char n)
+{
+    __m128i x = _mm_add_epi8(_mm_sub_epi8(v, _mm_set1_epi8(lo)),
+            _mm_set1_epi8(-128));
+    return _mm_cmpgt_epi8(_mm_set1_epi8(n - 128), x);
+}
+
+static void
+scan_classify(const char *p, uint32_t mask[N_CLASSES])
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alnum = _mm_or_si128(scan_in_range(lower, 'a', 26),
+            scan_in_range(v, '0', 10));
+    __m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    __m128i newline = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+    mask[CLASS_SPACE] = _mm_movemask_epi8(space);
+    mask[CLASS_NAME] = _mm_movemask_epi8(_mm_or_si128(alnum, under));
+    mask[CLASS_NUMBER] = _mm_movemask_epi8(alnum);
+    mask[CLASS_NEWLINE] = _mm_movemask_epi8(newline);
+}
+#endif
+
+#ifdef SCAN_VECTOR
+static void
+scan_load(Scanner *sc, size_t block)
+{
+    sc->block = block;
+    for (int k = 0; k < N_CLASSES; k++) {
+        sc->mask[k] = 0;
+    }
+    for (size_t off = 0; off < 64; off += SCAN_VECTOR) {
+        uint32_t mask[N_CLASSES];
+        scan_classify(sc->s + block + off, mask);
+        for (int k = 0; k < N_CLASSES; k++) {
+            sc->mask[k] |= (uint64_t)mask[k] << off;
+        }
+    }
+}
+
+// Returns the index of the first character at or after i that is (if
+// want is true) or is not in the class, using the block masks.  Sets i
+// to where the scalar loop has to take over if the end of the code is
+// too close for a whole block.
+static inline bool
+scan_vector(Scanner *sc, size_t *i, CharClass cls, bool want)
+{
+    while (*i < sc->len) {
+        size_t block = *i & ~(size_t)63;
+        if (block != sc->block) {
+            if (block + 64 > sc->len) {
+                return false;
+            }
+            scan_load(sc, block);
+        }
+        uint64_t hits = want ? sc->mask[cls] : ~sc->mask[cls];
+        hits >>= *i - block;
+        if (hits) {
+            *i += __builtin_ctzll(hits);
+            return true;
+        }
+        *i = block + 64;
+    }
+    return true;
+}
+#endif
+
+// Returns the index of the first character at or after i that is not in
+// the class, or the end of the code if there is none.
+static inline size_t
+scan_class(Scanner *sc, size_t i, CharClass cls)
+{
+    // Most runs are a character or two long: a space after a comma, or a
+    // register name.  Those end before a bit scan would pay off.
+    for (int k = 0; k < 2; k++, i++) {
+        if (i >= sc->len || !in_class(sc->s[i], cls)) {
+            return i;
+        }
+    }
+#ifdef SCAN_VECTOR
+    if (scan_vector(sc, &i, cls, false)) {
+        return i < sc->len ? i : sc->len;
+    }
+#endif
+    while (i < sc->len && in_class(sc->s[i], cls)) {
+        i++;
+    }
+    return i;
+}
+
+// Returns the index of the first character at or after i that is in the
+// class, or the end of the code if there is none.
+static inline size_t
+scan_to(Scanner *sc, size_t i, CharClass cls)
+{
+#ifdef SCAN_VECTOR
+    if (scan_vector(sc, &i, cls, true)) {
+        return i < sc->len ? i : sc->len;
+    }
+#endif
+    while (i < sc->len && !in_class(sc->s[i], cls)) {
+        i++;
+    }
+    return i;
+}
@@ -0,0 +1,497 @@
+// The assembler as a server on a Unix domain socket, for callers that
+// assemble too many sources to start a process for each.
+//
+// A client connects and sends any number of requests, each answered
+// before the next is read.  All numbers are little-endian.
+//
+// A request is a 16-byte header and the source:
+//
+//     uint64  length of the source
+//     uint32  options: bit 0 selects RV32 instead of RV64, and bit 1
+//             emits the 16-bit forms of the C extension
+//     uint32  0
+//
+// A reply is a 24-byte header, the image and the errors:
+//
+//     uint32  0 if the source was assembled, 1 if it has errors
+//     uint32  0
+//     uint64  length of the image
+//     uint64  length of the errors
+//
+// The errors are text, one per line, as rvas prints them.  The image is
+// empty if there are errors.
+//
+// One thread watches all the connections and reads the requests as their
+// bytes arrive, so a client that is slow or idle holds no thread.  A
+// complete request is handed to one of a fixed number of threads, each
+// with its own library context, so the tables and buffers stay warm from
+// one request to the next.  A client that stops in the middle of a
+// request, or does not take its reply, for SERVER_TIMEOUT seconds is
+// disconnected.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <time.h>
+
+// Requests with a bigger source are refused by closing the connection,
+// unless --max-source sets another limit.
+#define SERVER_MAX_SOURCE ((uint64_t)64 << 20)
+
+#define SERVER_TIMEOUT 10
+
+#define SERVER_OPT_RV32 1
+#define SERVER_OPT_COMPRESS 2
+
+static uint64_t
+get_le(const uint8_t *p, int n)
+{
+    uint64_t x = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        x = x << 8 | p[i];
+    }
+    return x;
+}
+
+static void
+put_le(uint8_t *p, uint64_t x, int n)
+{
+    for (int i = 0; i < n; i++) {
+        p[i] = x >> (8 * i);
+    }
+}
+
+static bool
+writev_full(int fd, struct iovec *iov, int n_iov)
+{
+    while (n_iov) {
+        ssize_t n = writev(fd, iov, n_iov);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            // Also when the client did not take the reply in time.
+            return false;
+        }
+        while (n_iov && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// A connection, and the request it is reading.
+struct ServerConn {
+    int fd;
+    bool busy;        // Its request is queued or being assembled.
+    time_t last;      // When it last received bytes or sent a reply.
+    uint8_t header[16];
+    uint64_t got;     // Bytes of the request read, header included.
+    uint64_t len;     // Of the source, once the header is read.
+    char *source;
+    size_t cap_source;
+    struct ServerConn *prev;  // In the list of all connections.
+    struct ServerConn *next;
+    struct ServerConn *next_request;  // In the queue of requests.
+};
+typedef struct ServerConn ServerConn;
+
+struct Server {
+    int listen_fd;
+    int epoll_fd;
+    uint64_t max_source;
+    pthread_mutex_t lock;  // Guards everything below.
+    pthread_cond_t queued;
+    ServerConn *conns;
+    ServerConn *first_request;
+    ServerConn *last_request;
+};
+typedef struct Server Server;
+
+struct ServerThread {
+    pthread_t thread;
+    Server *server;
+    Rvas *ctx;
+    char *errors;
+    size_t cap_errors;
+};
+typedef struct ServerThread ServerThread;
+
+static time_t
+server_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Takes c out of the list of connections, with the lock held.
+static void
+server_unlink(Server *srv, ServerConn *c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        srv->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+}
+
+static void
+server_free(ServerConn *c)
+{
+    close(c->fd);
+    free(c->source);
+    free(c);
+}
+
+static void
+server_close(Server *srv, ServerConn *c)
+{
+    pthread_mutex_lock(&srv->lock);
+    server_unlink(srv, c);
+    pthread_mutex_unlock(&srv->lock);
+    server_free(c);
+}
+
+// Watches the connection for the next bytes of its request.  It is only
+// watched until they arrive, so that once a request is complete no more
+// is read until it has been answered.  Returns false if it cannot be
+// watched, and the connection must be closed.
+static bool
+server_watch(Server *srv, ServerConn *c)
+{
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT,
+        .data.ptr = c};
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0) {
+        return true;
+    }
+    return errno == ENOENT
+        && epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == 0;
+}
+
+static void
+server_accept(Server *srv)
+{
+    for (;;) {
+        // The connections block, so that a reply is written at once,
+        // but only until the timeout.
+        int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                print_error("Could not accept a connection: %s\n",
+                        strerror(errno));
+            }
+            return;
+        }
+        struct timeval tv = {.tv_sec = SERVER_TIMEOUT};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        ServerConn *c = calloc(1, sizeof *c);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->last = server_now();
+        pthread_mutex_lock(&srv->lock);
+        c->next = srv->conns;
+        if (c->next) {
+            c->next->prev = c;
+        }
+        srv->conns = c;
+        pthread_mutex_unlock(&srv->lock);
+        if (!server_watch(srv, c)) {
+            server_close(srv, c);
+        }
+    }
+}
+
+// Reads what has arrived of the request of c, and queues it once it is
+// complete.  Returns false if the connection must be closed.
+static bool
+server_read(Server *srv, ServerConn *c)
+{
+    while (c->got < sizeof c->header || c->got < sizeof c->header + c->len) {
+        uint8_t *buf;
+        size_t want;
+        if (c->got < sizeof c->header) {
+            buf = c->header + c->got;
+            want = sizeof c->header - c->got;
+        } else {
+            // The source grows as its bytes arrive, not as large as the
+            // header says at once.
+            uint64_t have = c->got - sizeof c->header;
+            want = c->len - have < 65536 ? c->len - have : 65536;
+            if (have + want > c->cap_source) {
+                size_t cap = c->cap_source ? c->cap_source : 65536;
+                while (cap < have + want) {
+                    cap *= 2;
+                }
+                cap = cap < c->len ? cap : c->len;
+                char *source = realloc(c->source, cap);
+                if (!source) {
+                    print_error("Out of memory for a request of %llu "
+                            "bytes\n", (unsigned long long)c->len);
+                    return false;
+                }
+                c->source = source;
+                c->cap_source = cap;
+            }
+            buf = (uint8_t *)c->source + have;
+        }
+        ssize_t n = recv(c->fd, buf, want, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return server_watch(srv, c);
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->got += n;
+        c->last = server_now();
+        if (c->got == sizeof c->header) {
+            c->len = get_le(c->header, 8);
+            if (c->len > srv->max_source) {
+                return false;
+            }
+        }
+    }
+
+    // It is not watched until its reply is written.
+    pthread_mutex_lock(&srv->lock);
+    c->busy = true;
+    c->next_request = NULL;
+    if (srv->last_request) {
+        srv->last_request->next_request = c;
+    } else {
+        srv->first_request = c;
+    }
+    srv->last_request = c;
+    pthread_cond_signal(&srv->queued);
+    pthread_mutex_unlock(&srv->lock);
+    return true;
+}
+
+// Disconnects the clients that stopped in the middle of a request.
+static void
+server_expire(Server *srv, time_t now)
+{
+    pthread_mutex_lock(&srv->lock);
+    ServerConn *expired = NULL;
+    for (ServerConn *c = srv->conns, *next; c; c = next) {
+        next = c->next;
+        if (!c->busy && c->got && now - c->last >= SERVER_TIMEOUT) {
+            server_unlink(srv, c);
+            c->next_request = expired;
+            expired = c;
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+    while (expired) {
+        ServerConn *c = expired;
+        expired = c->next_request;
+        server_free(c);
+    }
+}
+
+// Watches the listening socket and the connections.
+static void
+server_poll(Server *srv)
+{
+    time_t expired = server_now();
+    for (;;) {
+        struct epoll_event events[64];
+        int n = epoll_wait(srv->epoll_fd, events, ARR_SIZE(events), 1000);
+        if (n < 0 && errno != EINTR) {
+            print_error("Could not wait for clients: %s\n", strerror(errno));
+            abort();
+        }
+        for (int i = 0; i < n; i++) {
+            ServerConn *c = events[i].data.ptr;
+            if (!c) {
+                server_accept(srv);
+            } else if (!server_read(srv, c)) {
+                server_close(srv, c);
+            }
+        }
+        time_t now = server_now();
+        if (now != expired) {
+            server_expire(srv, now);
+            expired = now;
+        }
+    }
+}
+
+// Formats the errors of the last source into t->errors.  Returns their
+// length.
+static size_t
+format_errors(ServerThread *t)
+{
+    size_t n_diags;
+    const RvasDiag *diags = rvas_diags(t->ctx, &n_diags);
+    size_t len = 0;
+    for (size_t i = 0; i < n_diags; i++) {
+        const RvasDiag *d = &diags[i];
+        size_t need = strlen(d->msg) + 32;
+        t->errors = grow(t->errors, &t->cap_errors, len + need, 1);
+        if (d->line) {
+            len += snprintf(t->errors + len, need, "line %zu: %s\n",
+                    d->line, d->msg);
+        } else {
+            len += snprintf(t->errors + len, need, "%s\n", d->msg);
+        }
+    }
+    return len;
+}
+
+// Assembles the request of c and writes the reply.  Returns false if the
+// connection must be closed.
+static bool
+serve_request(ServerThread *t, ServerConn *c)
+{
+    uint32_t options = get_le(c->header + 8, 4);
+    rvas_set_target(t->ctx, options & SERVER_OPT_COMPRESS
+            ? (options & SERVER_OPT_RV32 ? RVAS_RV32C : RVAS_RV64C)
+            : (options & SERVER_OPT_RV32 ? RVAS_RV32 : RVAS_RV64));
+    RvasOutput image;
+    int status = rvas_assemble(t->ctx, c->source, c->len, &image) ? 1 : 0;
+    // rvas_assemble reports running out of memory as an error, and so
+    // only this client is dropped if the errors do not fit.
+    jmp_buf jump;
+    if (setjmp(jump)) {
+        oom_jump = NULL;
+        print_error("Out of memory for the errors of a request\n");
+        return false;
+    }
+    oom_jump = &jump;
+    size_t errors_len = format_errors(t);
+    oom_jump = NULL;
+
+    uint8_t reply[24] = {0};
+    put_le(reply, status, 4);
+    put_le(reply + 8, image.len, 8);
+    put_le(reply + 16, errors_len, 8);
+    struct iovec iov[] = {
+        {reply, sizeof reply},
+        {(void *)image.data, image.len},
+        {t->errors, errors_len},
+    };
+    return writev_full(c->fd, iov, ARR_SIZE(iov));
+}
+
+static void *
+server_run(void *arg)
+{
+    ServerThread *t = arg;
+    Server *srv = t->server;
+    for (;;) {
+        pthread_mutex_lock(&srv->lock);
+        while (!srv->first_request) {
+            pthread_cond_wait(&srv->queued, &srv->lock);
+        }
+        ServerConn *c = srv->first_request;
+        srv->first_request = c->next_request;
+        if (!srv->first_request) {
+            srv->last_request = NULL;
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        bool ok = serve_request(t, c);
+        c->got = 0;
+        c->len = 0;
+        if (c->cap_source > 1 << 20) {
+            // Do not keep a big source for an idle client.
+            free(c->source);
+            c->source = NULL;
+            c->cap_source = 0;
+        }
+        pthread_mutex_lock(&srv->lock);
+        c->busy = false;
+        c->last = server_now();
+        pthread_mutex_unlock(&srv->lock);
+        if (!ok || !server_watch(srv, c)) {
+            server_close(srv, c);
+        }
+    }
+    return NULL;
+}
+
+// Serves clients on the socket at path with n_threads threads, refusing
+// sources of more than max_source bytes.  Only returns if the server
+// cannot be started.
+static bool
+serve(const char *path, int n_threads, uint64_t max_source)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path) {
+        print_error("Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier server would make bind fail.
+    struct stat sb;
+    if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+        unlink(path);
+    }
+
+    Server srv = {
+        .max_source = max_source,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .queued = PTHREAD_COND_INITIALIZER,
+    };
+    srv.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (srv.listen_fd == -1
+            || bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof addr)
+                == -1
+            || listen(srv.listen_fd, SOMAXCONN) == -1)
+    {
+        print_error("Could not listen on %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (srv.epoll_fd == -1
+            || epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.listen_fd, &ev)
+                == -1)
+    {
+        print_error("Could not watch %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    // A client that goes away must not take the server with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    ServerThread *threads = calloc(n_threads, sizeof *threads);
+    if (!threads) {
+        out_of_memory();
+    }
+    for (int i = 0; i < n_threads; i++) {
+        ServerThread *t = &threads[i];
+        t->server = &srv;
+        t->ctx = rvas_new();
+        if (!t->ctx) {
+            out_of_memory();
+        }
+        if (pthread_create(&t->thread, NULL, server_run, t)) {
+            print_error("Could not start thread.\n");
+            return false;
+        }
+    }
+    server_poll(&srv);
+    return true;
+}
@@ -0,0 +1,196 @@
+// Measurements of a run, printed with --stats.
+//
+// Every phase is timed, and where the kernel allows it the hardware
+// counters of the process are read at the start and end of the phase.
+// The counters count the threads too, since they are joined before the
+// phase ends.  Lexing, matching the mnemonics and encoding are done line
+// by line, so they are one phase.
+
+#include <inttypes.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum StatsPhase {
+    STATS_READ,
+    STATS_ASSEMBLE,
+    STATS_RESOLVE,
+    STATS_WRITE,
+    N_STATS_PHASES,
+};
+typedef enum StatsPhase StatsPhase;
+
+static const char *stats_phase_names[] = {
+    "read", "assemble", "resolve", "write",
+};
+
+enum StatsCounter {
+    STATS_CYCLES,
+    STATS_INSTRUCTIONS,
+    STATS_CACHE_MISSES,
+    STATS_BRANCH_MISSES,
+    N_STATS_COUNTERS,
+};
+
+static const struct {
+    const char *name;
+    uint64_t config;
+} stats_counters[] = {
+    {"cycles", PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+struct Stats {
+    bool json;
+    int fds[N_STATS_COUNTERS];  // -1 if the counter is not available.
+    StatsPhase phase;
+    double phase_start;
+    uint64_t counter_start[N_STATS_COUNTERS];
+    double secs[N_STATS_PHASES];
+    uint64_t counts[N_STATS_PHASES][N_STATS_COUNTERS];
+
+    bool cached;
+    size_t lines;
+    size_t labels;
+    size_t consts;
+    size_t fixups;
+    uint64_t bytes;
+};
+typedef struct Stats Stats;
+
+static double
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t
+stats_read_counter(int fd)
+{
+    uint64_t value;
+    if (fd == -1 || read(fd, &value, sizeof value) != sizeof value) {
+        return 0;
+    }
+    return value;
+}
+
+// Opens the counters and starts the first phase.  The counters that
+// cannot be opened, usually because perf_event_paranoid forbids it, are
+// left out.
+static void
+stats_init(Stats *stats, bool json)
+{
+    *stats = (Stats){.json = json};
+    for (int c = 0; c < N_STATS_COUNTERS; c++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof attr,
+            .config = stats_counters[c].config,
+            .inherit = 1,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+        };
+        stats->fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                PERF_FLAG_FD_CLOEXEC);
+        stats->counter_start[c] = stats_read_counter(stats->fds[c]);
+    }
+    stats->phase_start = stats_now();
+}
+
+// Ends the current phase and starts the next one.
+static void
+stats_next_phase(Stats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    StatsPhase p = stats->phase;
+    double now = stats_now();
+    stats->secs[p] = now - stats->phase_start;
+    stats->phase_start = now;
+    for (int c = 0; c < N_STATS_COUNTERS; c++) {
+        uint64_t value = stats_read_counter(stats->fds[c]);
+        stats->counts[p][c] = value - stats->counter_start[c];
+        stats->counter_start[c] = value;
+    }
+    stats->phase++;
+}
+
+// Counts what was assembled.
+static void
+stats_count(Stats *stats, const State *st, const Output *out)
+{
+    if (!stats) {
+        return;
+    }
+    stats->lines = st->line;
+    for (size_t i = 0; i < st->symtab.n_syms; i++) {
+        SymKind kind = st->symtab.syms[i].kind;
+        stats->labels += kind == SYM_LABEL;
+        stats->consts += kind == SYM_CONST;
+    }
+    stats->fixups = st->n_fixups;
+    stats->bytes = out->output_len;
+}
+
+static void
+stats_print(Stats *stats, FILE *f)
+{
+    for (int c = 0; c < N_STATS_COUNTERS; c++) {
+        if (stats->fds[c] != -1) {
+            close(stats->fds[c]);
+        }
+    }
+    if (stats->json) {
+        fprintf(f, "{\"cached\": %s, \"lines\": %zu, \"labels\": %zu, "
+                "\"consts\": %zu, \"fixups\": %zu, \"bytes\": %" PRIu64
+                ", \"phases\": {", stats->cached ? "true" : "false",
+                stats->lines, stats->labels, stats->consts, stats->fixups,
+                stats->bytes);
+        for (int p = 0; p < N_STATS_PHASES; p++) {
+            fprintf(f, "%s\"%s\": {\"seconds\": %.9f", p ? ", " : "",
+                    stats_phase_names[p], stats->secs[p]);
+            for (int c = 0; c < N_STATS_COUNTERS; c++) {
+                if (stats->fds[c] == -1) {
+                    fprintf(f, ", \"%s\": null", stats_counters[c].name);
+                } else {
+                    fprintf(f, ", \"%s\": %" PRIu64, stats_counters[c].name,
+                            stats->counts[p][c]);
+                }
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "}}\n");
+        return;
+    }
+
+    fprintf(f, "lines %zu, labels %zu, consts %zu, fixups %zu, "
+            "bytes %" PRIu64 "%s\n", stats->lines, stats->labels,
+            stats->consts, stats->fixups, stats->bytes,
+            stats->cached ? " (from the cache)" : "");
+    fprintf(f, "%-10s %12s", "phase", "ms");
+    for (int c = 0; c < N_STATS_COUNTERS; c++) {
+        fprintf(f, " %14s", stats_counters[c].name);
+    }
+    fprintf(f, "\n");
+    for (int p = 0; p < N_STATS_PHASES; p++) {
+        fprintf(f, "%-10s %12.3f", stats_phase_names[p],
+                stats->secs[p] * 1e3);
+        for (int c = 0; c < N_STATS_COUNTERS; c++) {
+            if (stats->fds[c] == -1) {
+                fprintf(f, " %14s", "-");
+            } else {
+                fprintf(f, " %14" PRIu64, stats->counts[p][c]);
+            }
+        }
+        fprintf(f, "\n");
+    }
+    if (stats->fds[STATS_CYCLES] == -1) {
+        fprintf(f, "Hardware counters are not available "
+                "(see /proc/sys/kernel/perf_event_paranoid).\n");
+    }
+}
@@ -0,0 +1,475 @@
+// Assembling a stream, such as a pipe, that cannot be mapped.
+//
+// The input is read in blocks of whole lines, and every block is
+// assembled as soon as it is read.  A fixup whose symbol is defined
+// already is filled in at once; the others wait in a chain on their
+// symbol, and the chain is filled in at the end of the block that
+// defines the symbol.  The output before the oldest waiting fixup cannot
+// change any more, so it is written and freed.  The memory used depends
+// on how far ahead the code refers, and on the number of symbols, but not
+// on the size of the code.
+//
+// A %pcrel_lo takes its value from the %pcrel_hi at its label, so the
+// %pcrel_hi fixups that have a label are kept, and a %pcrel_lo waits until
+// both its label and the symbol of that %pcrel_hi are defined.  They are
+// only kept for the next STREAM_PCREL_WINDOW bytes of output, so a
+// %pcrel_lo further than that after its %pcrel_hi is an error.
+//
+// Since the output is written as the code is assembled, an error leaves
+// it cut short.  For the same reason, a branch that does not reach its
+// label cannot be made longer, and is an error.
+
+#define STREAM_BLOCK (1 << 20)
+#define STREAM_PCREL_WINDOW (1 << 20)
+
+// A fixup waiting for its symbol.
+struct Pending {
+    Fixup fixup;
+    size_t line;
+    size_t next;  // Index of the next one of the symbol, or SIZE_MAX.
+};
+typedef struct Pending Pending;
+
+// The pending fixups of a symbol, oldest first.
+struct Chain {
+    size_t head;
+    size_t tail;
+};
+typedef struct Chain Chain;
+
+// A %pcrel_hi fixup that has a label.
+struct PcrelHi {
+    uint64_t offset;
+    SymId sym;
+};
+typedef struct PcrelHi PcrelHi;
+
+struct Stream {
+    State st;
+    Output out;
+    int out_fd;
+    uint64_t written;  // The output before this has been written.
+
+    Pending *pending;
+    size_t n_pending;
+    size_t cap_pending;
+    size_t free_pending;  // Index of a free Pending, or SIZE_MAX.
+
+    Chain *chains;  // By SymId.
+    size_t cap_chains;
+    SymId *waiting;  // The symbols with a chain.
+    size_t n_waiting;
+    size_t cap_waiting;
+
+    PcrelHi *pcrel_his;  // In output order.
+    size_t n_pcrel_his;
+    size_t cap_pcrel_his;
+    Fixup *pcrel_los;  // The %pcrel_lo fixups that are not filled in.
+    size_t n_pcrel_los;
+    size_t cap_pcrel_los;
+
+    // The names of the symbols point into the block, so they are copied
+    // here before it is reused.
+    size_t n_named;
+    char *names;
+    size_t names_left;
+    char **name_blocks;
+    size_t n_name_blocks;
+    size_t cap_name_blocks;
+};
+typedef struct Stream Stream;
+
+static Str
+stream_copy_name(Stream *s, Str name)
+{
+    if (s->names_left < name.len) {
+        size_t size = name.len > 64 * 1024 ? name.len : 64 * 1024;
+        s->name_blocks = grow(s->name_blocks, &s->cap_name_blocks,
+                s->n_name_blocks + 1, sizeof *s->name_blocks);
+        s->names = malloc(size);
+        if (!s->names) {
+            out_of_memory();
+        }
+        s->name_blocks[s->n_name_blocks++] = s->names;
+        s->names_left = size;
+    }
+    memcpy(s->names, name.data, name.len);
+    Str copy = {s->names, name.len};
+    s->names += name.len;
+    s->names_left -= name.len;
+    return copy;
+}
+
+// Returns the %pcrel_hi at offset, or NULL.
+static const PcrelHi *
+stream_find_pcrel_hi(const PcrelHi *his, size_t n, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((his[mid].offset & ~(uint64_t)1) < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && (his[lo].offset & ~(uint64_t)1) == offset
+        ? &his[lo] : NULL;
+}
+
+// Returns where the output at offset is.  It must not have been written.
+static uint8_t *
+stream_output_at(Output *out, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = out->n_chunks;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (out->chunks[mid].start <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return out->chunks[lo].data + (offset - out->chunks[lo].start);
+}
+
+// Keeps the %pcrel_hi fixups recorded since the last block that have a
+// label, which can only be one of the labels it defined.
+static void
+stream_add_pcrel_his(Stream *s)
+{
+    State *st = &s->st;
+    size_t first = s->n_pcrel_his;
+    for (size_t i = 0; i < st->n_fixups; i++) {
+        if (st->fixups[i].kind == FIXUP_PCREL_HI) {
+            s->pcrel_his = grow(s->pcrel_his, &s->cap_pcrel_his,
+                    s->n_pcrel_his + 1, sizeof *s->pcrel_his);
+            s->pcrel_his[s->n_pcrel_his++] = (PcrelHi) {
+                st->fixups[i].offset, st->fixups[i].sym,
+            };
+        }
+    }
+    size_t n_labels = st->n_labels;
+    st->n_labels = 0;
+    if (s->n_pcrel_his == first) {
+        return;
+    }
+
+    // Mark the ones with a label by making their offset odd, then drop
+    // the others.
+    for (size_t i = 0; i < n_labels; i++) {
+        const Symbol *sym = &st->symtab.syms[st->labels[i]];
+        const PcrelHi *hi = stream_find_pcrel_hi(s->pcrel_his + first,
+                s->n_pcrel_his - first, sym->value);
+        if (hi) {
+            s->pcrel_his[hi - s->pcrel_his].offset |= 1;
+        }
+    }
+    size_t n = first;
+    for (size_t i = first; i < s->n_pcrel_his; i++) {
+        if (s->pcrel_his[i].offset & 1) {
+            s->pcrel_his[n] = s->pcrel_his[i];
+            s->pcrel_his[n++].offset &= ~(uint64_t)1;
+        }
+    }
+    s->n_pcrel_his = n;
+}
+
+// Fills in a fixup of the line whose symbol is defined.
+static void
+stream_apply(Stream *s, const Fixup *f, size_t line, const Symbol *sym)
+{
+    int64_t value = fixup_value(f, sym->value);
+    if (!fixup_in_range(f->kind, value)) {
+        error_at(&s->st, 0, line, "Branch out of range: %.*s",
+                (int)sym->name.len, sym->name.data);
+        return;
+    }
+    fixup_apply(stream_output_at(&s->out, f->offset), f->kind, value);
+}
+
+// Fills in the fixups recorded since the last block, or chains them to
+// their symbols, or keeps them for later if they are %pcrel_lo.
+static void
+stream_add_fixups(Stream *s)
+{
+    State *st = &s->st;
+    if (st->symtab.n_syms > s->cap_chains) {
+        size_t old = s->cap_chains;
+        s->chains = grow(s->chains, &s->cap_chains, st->symtab.n_syms,
+                sizeof *s->chains);
+        for (size_t i = old; i < s->cap_chains; i++) {
+            s->chains[i] = (Chain){SIZE_MAX, SIZE_MAX};
+        }
+    }
+    for (size_t i = 0; i < st->n_fixups; i++) {
+        const Fixup *f = &st->fixups[i];
+        const Symbol *sym = &st->symtab.syms[f->sym];
+        if (f->kind == FIXUP_PCREL_LO_I || f->kind == FIXUP_PCREL_LO_S) {
+            s->pcrel_los = grow(s->pcrel_los, &s->cap_pcrel_los,
+                    s->n_pcrel_los + 1, sizeof *s->pcrel_los);
+            s->pcrel_los[s->n_pcrel_los++] = *f;
+            continue;
+        }
+        if (sym->kind != SYM_UNDEFINED) {
+            stream_apply(s, f, st->fixup_lines[i], sym);
+            continue;
+        }
+        size_t k = s->free_pending;
+        if (k != SIZE_MAX) {
+            s->free_pending = s->pending[k].next;
+        } else {
+            s->pending = grow(s->pending, &s->cap_pending, s->n_pending + 1,
+                    sizeof *s->pending);
+            k = s->n_pending++;
+        }
+        s->pending[k] = (Pending){*f, st->fixup_lines[i], SIZE_MAX};
+        Chain *c = &s->chains[f->sym];
+        if (c->head == SIZE_MAX) {
+            c->head = k;
+            s->waiting = grow(s->waiting, &s->cap_waiting, s->n_waiting + 1,
+                    sizeof *s->waiting);
+            s->waiting[s->n_waiting++] = f->sym;
+        } else {
+            s->pending[c->tail].next = k;
+        }
+        c->tail = k;
+    }
+    st->n_fixups = 0;
+}
+
+// Fills in the chains of the symbols that have been defined, and returns
+// the offset of the oldest fixup that is still waiting, or the end of the
+// output if there is none.  After the last block, a %pcrel_lo whose label
+// is at the end of the output has no %pcrel_hi.
+static uint64_t
+stream_resolve(Stream *s, bool last)
+{
+    uint64_t oldest = s->out.output_len;
+    for (size_t i = 0; i < s->n_waiting;) {
+        SymId id = s->waiting[i];
+        Chain *c = &s->chains[id];
+        const Symbol *sym = &s->st.symtab.syms[id];
+        if (sym->kind == SYM_UNDEFINED) {
+            uint64_t offset = s->pending[c->head].fixup.offset;
+            if (offset < oldest) {
+                oldest = offset;
+            }
+            i++;
+            continue;
+        }
+        for (size_t k = c->head; k != SIZE_MAX;) {
+            Pending *p = &s->pending[k];
+            stream_apply(s, &p->fixup, p->line, sym);
+            size_t next = p->next;
+            p->next = s->free_pending;
+            s->free_pending = k;
+            k = next;
+        }
+        *c = (Chain){SIZE_MAX, SIZE_MAX};
+        s->waiting[i] = s->waiting[--s->n_waiting];
+    }
+
+    for (size_t i = 0; i < s->n_pcrel_los;) {
+        const Fixup *f = &s->pcrel_los[i];
+        const Symbol *label = &s->st.symtab.syms[f->sym];
+        const PcrelHi *hi = label->kind == SYM_LABEL
+            ? stream_find_pcrel_hi(s->pcrel_his, s->n_pcrel_his, label->value)
+            : NULL;
+        // A label at the end of the output has nothing after it until
+        // the last block.
+        if (label->kind == SYM_UNDEFINED
+                || (hi && s->st.symtab.syms[hi->sym].kind == SYM_UNDEFINED)
+                || (!last && label->kind == SYM_LABEL
+                    && (uint64_t)label->value >= s->out.output_len))
+        {
+            if (f->offset < oldest) {
+                oldest = f->offset;
+            }
+            i++;
+            continue;
+        }
+        if (label->kind == SYM_LABEL && label->value + STREAM_PCREL_WINDOW
+                < (int64_t)f->offset)
+        {
+            error_at(&s->st, label->file, label->line,
+                    "%%pcrel_lo too far after its %%pcrel_hi: %.*s",
+                    (int)label->name.len, label->name.data);
+        } else if (hi) {
+            fixup_apply(stream_output_at(&s->out, f->offset), f->kind,
+                    s->st.symtab.syms[hi->sym].value - label->value);
+        } else {
+            error_at(&s->st, label->file, label->line,
+                    "No %%pcrel_hi at label: %.*s",
+                    (int)label->name.len, label->name.data);
+        }
+        s->pcrel_los[i] = s->pcrel_los[--s->n_pcrel_los];
+    }
+    return oldest;
+}
+
+// Writes the output before end, and frees the chunks that are done.  The
+// last chunk is kept for the output to come.
+static bool
+stream_flush(Stream *s, uint64_t end)
+{
+    Output *out = &s->out;
+    size_t done = 0;
+    for (size_t k = 0; k < out->n_chunks; k++) {
+        Chunk *c = &out->chunks[k];
+        uint64_t to = c->start + c->len < end ? c->start + c->len : end;
+        if (to > s->written) {
+            if (!write_all(s->out_fd, c->data + (s->written - c->start),
+                        to - s->written))
+            {
+                return false;
+            }
+            s->written = to;
+        }
+        if (to < c->start + c->len) {
+            break;
+        }
+        if (k + 1 < out->n_chunks || c->file) {
+            output_free_chunk(out, c);
+            done++;
+        } else {
+            c->start = out->output_len;
+            c->len = 0;
+        }
+    }
+    memmove(out->chunks, out->chunks + done,
+            (out->n_chunks - done) * sizeof *out->chunks);
+    out->n_chunks -= done;
+    return true;
+}
+
+// Drops the %pcrel_hi fixups that no later %pcrel_lo can use, and that
+// have been written.  One that a waiting %pcrel_lo uses has not been: if
+// it is not filled in, it holds back the output from it.
+static void
+stream_drop_pcrel_his(Stream *s)
+{
+    uint64_t end = s->out.output_len > STREAM_PCREL_WINDOW
+        ? s->out.output_len - STREAM_PCREL_WINDOW : 0;
+    end = end < s->written ? end : s->written;
+    size_t n = 0;
+    while (n < s->n_pcrel_his && s->pcrel_his[n].offset < end) {
+        n++;
+    }
+    if (n) {
+        memmove(s->pcrel_his, s->pcrel_his + n,
+                (s->n_pcrel_his - n) * sizeof *s->pcrel_his);
+        s->n_pcrel_his -= n;
+    }
+}
+
+// Assembles the whole lines of buf, which start at offset pos of the input.
+// The last block is the rest of the input.
+static bool
+stream_block(Stream *s, const char *buf, size_t len, uint64_t pos,
+        bool last, Target target)
+{
+    State *st = &s->st;
+    st->code = (Str){buf, len};
+    st->i = 0;
+    st->pos_base = pos;
+    st->scanner = scanner(st->code);
+    assemble(st, &s->out, target);
+    for (; s->n_named < st->symtab.n_syms; s->n_named++) {
+        Symbol *sym = &st->symtab.syms[s->n_named];
+        sym->name = stream_copy_name(s, sym->name);
+    }
+    stream_add_pcrel_his(s);
+    stream_add_fixups(s);
+    // Nothing before an alignment changes size, so its padding is final.
+    st->n_aligns = 0;
+    uint64_t end = stream_resolve(s, last);
+    // Once there is an error, the output is of no use.
+    if (st->n_errors) {
+        return true;
+    }
+    if (!stream_flush(s, end)) {
+        return false;
+    }
+    stream_drop_pcrel_his(s);
+    return true;
+}
+
+// Assembles the code read from fd and writes the image to out_fd as it
+// goes.
+static bool
+stream(int fd, const char *name, Target target, int out_fd)
+{
+    Stream s = {
+        .st.stream = true,
+        .out_fd = out_fd,
+        .free_pending = SIZE_MAX,
+    };
+    size_t cap = STREAM_BLOCK;
+    char *buf = malloc(cap);
+    if (!buf) {
+        out_of_memory();
+    }
+    size_t len = 0;
+    uint64_t pos = 0;
+    bool read_ok = true;
+    bool write_ok = true;
+    while (write_ok) {
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            read_ok = false;
+            break;
+        }
+        len += n;
+        if (n == 0) {
+            write_ok = stream_block(&s, buf, len, pos, true, target);
+            break;
+        }
+        const char *nl = memrchr(buf, '\n', len);
+        if (!nl) {
+            if (len == cap) {
+                buf = grow(buf, &cap, cap + 1, 1);
+            }
+            continue;
+        }
+        size_t whole = nl - buf + 1;
+        write_ok = stream_block(&s, buf, whole, pos, false, target);
+        pos += whole;
+        memmove(buf, buf + whole, len - whole);
+        len -= whole;
+    }
+    free(buf);
+
+    // The fixups are all filled in already, so this only reports the
+    // symbols that are undefined.
+    resolve_fixups(&s.st, &s.out);
+    bool ok = read_ok && write_ok && s.st.n_errors == 0;
+    if (ok && !stream_flush(&s, s.out.output_len)) {
+        write_ok = ok = false;
+    }
+    if (!read_ok) {
+        fprintf(stderr, "Could not read file: %s\n", name);
+    } else if (!write_ok) {
+        print_error("Could not write output.\n");
+    }
+    Source source = {.name = name};
+    print_diags(&s.st, &source, 1);
+
+    state_free(&s.st);
+    output_free(&s.out);
+    free(s.pending);
+    free(s.chains);
+    free(s.waiting);
+    free(s.pcrel_his);
+    free(s.pcrel_los);
+    for (size_t i = 0; i < s.n_name_blocks; i++) {
+        free(s.name_blocks[i]);
+    }
+    free(s.name_blocks);
+    return ok;
+}
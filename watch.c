@@ -0,0 +1,667 @@
+// Watching a file and keeping its image up to date as it is edited.
+//
+// After the first assembly, the line table (where every line starts in
+// the code and in the image), the symbol table, the fixups and the image
+// are kept.  When the file changes, the lines that differ are found by
+// comparing the old and the new code from both ends, and only those are
+// assembled again, at the pc of the first of them.  The image, the lines,
+// the labels and the fixups after them move by the change in size.  Then
+// only the fixups whose value can have changed are resolved again: those
+// of the new lines, those that use a label of the changed lines, and,
+// if the size changed, those that use a label on the other side of the
+// change.  The image file is patched where it changed.
+//
+// Constants are not tracked: a .equ in the changed lines, before or after
+// the edit, or any error, makes it assemble the whole file again.  Nor is
+// a branch that was made longer made short again, so a change to the
+// value of one also does.
+
+#include <sys/inotify.h>
+#include <libgen.h>
+
+struct WatchLine {
+    size_t off;   // Offset of the line in the code.
+    uint64_t pc;  // Offset of its output in the image.
+};
+typedef struct WatchLine WatchLine;
+
+// Where a branch that was made longer is in the image.
+struct WatchRelaxed {
+    uint64_t start;
+    uint64_t end;
+};
+typedef struct WatchRelaxed WatchRelaxed;
+
+// Flags of the symbols during an update.
+enum {
+    WATCH_SYM_CHANGED = 1,  // Defined by the old or the new lines.
+    WATCH_SYM_MOVED = 2,    // A label after them.
+};
+
+struct Watch {
+    const char *input;
+    Target target;
+    int out_fd;
+
+    // Every code read so far, as the names of the symbols point into
+    // them.  The last one is the current code.
+    char **texts;
+    size_t n_texts;
+    size_t cap_texts;
+    size_t texts_size;
+    Str code;
+
+    bool valid;  // The tables below match the code.
+    WatchLine *lines;
+    size_t n_lines;
+    size_t cap_lines;
+    Symtab symtab;
+    Fixup *fixups;
+    size_t n_fixups;
+    size_t cap_fixups;
+    uint8_t *image;
+    size_t image_len;
+    size_t cap_image;
+
+    uint8_t *sym_flags;
+    size_t cap_sym_flags;
+    uint64_t align_end;  // Just after the last alignment, or 0.
+    WatchRelaxed *relaxed;
+    size_t n_relaxed;
+    size_t cap_relaxed;
+    uint64_t *patched;  // Offsets of the fixups patched by an update.
+    size_t n_patched;
+    size_t cap_patched;
+};
+typedef struct Watch Watch;
+
+// Assembles the lines of st, adding them to the line table.
+static void
+watch_assemble(State *st, Output *out, Target target, WatchLine **lines,
+        size_t *n_lines, size_t *cap_lines)
+{
+    for (;;) {
+        size_t off = st->i;
+        uint64_t pc = st->pc;
+        if (!lex_line(st)) {
+            break;
+        }
+        *lines = grow(*lines, cap_lines, *n_lines + 1, sizeof **lines);
+        (*lines)[(*n_lines)++] = (WatchLine){off, pc};
+        compile_line(out, st, target);
+    }
+}
+
+// Forgets everything that was assembled, and all codes but the current.
+static void
+watch_reset(Watch *w)
+{
+    for (size_t i = 0; i + 1 < w->n_texts; i++) {
+        free(w->texts[i]);
+    }
+    if (w->n_texts) {
+        w->texts[0] = w->texts[w->n_texts - 1];
+        w->n_texts = 1;
+    }
+    w->texts_size = w->code.len;
+    symtab_free(&w->symtab);
+    w->symtab = (Symtab){0};
+    w->n_lines = 0;
+    w->n_fixups = 0;
+    w->align_end = 0;
+    w->n_relaxed = 0;
+    w->image_len = 0;
+    w->valid = false;
+}
+
+static bool
+watch_write(Watch *w, uint64_t from, const uint8_t *data, size_t len)
+{
+    while (len) {
+        ssize_t n = pwrite(w->out_fd, data, len, from);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            print_error("Could not write output: %s\n", strerror(errno));
+            return false;
+        }
+        data += n;
+        len -= n;
+        from += n;
+    }
+    return true;
+}
+
+// Assembles the whole code and writes the whole image.
+static void
+watch_full(Watch *w)
+{
+    watch_reset(w);
+    State st = {
+        .code = w->code,
+        .scanner = scanner(w->code),
+    };
+    Output out = {0};
+    watch_assemble(&st, &out, w->target, &w->lines, &w->n_lines,
+            &w->cap_lines);
+    Relax relax;
+    relax_and_resolve(&st, &out, w->target, &relax);
+    for (size_t i = 0; relax.n && i < w->n_lines; i++) {
+        w->lines[i].pc = relax_offset(&relax, w->lines[i].pc,
+                w->lines[i].off);
+    }
+    for (size_t i = 0; i < relax.n; i++) {
+        int64_t added = relax.before[i + 1] - relax.before[i];
+        if (relax.pos[i] == UINT64_MAX && added > 0) {
+            uint64_t start = relax.offsets[i] + relax.before[i];
+            w->relaxed = grow(w->relaxed, &w->cap_relaxed, w->n_relaxed + 1,
+                    sizeof *w->relaxed);
+            w->relaxed[w->n_relaxed++] = (WatchRelaxed){start,
+                start + 4 + added};
+        }
+    }
+    relax_free(&relax);
+    free(st.toks);
+    w->symtab = st.symtab;
+    free(w->fixups);
+    w->fixups = st.fixups;
+    w->n_fixups = st.n_fixups;
+    w->cap_fixups = st.cap_fixups;
+    if (st.n_aligns) {
+        w->align_end = st.aligns[st.n_aligns - 1].offset + 1;
+    }
+    free(st.aligns);
+
+    bool ok = st.n_errors == 0;
+    print_diags(&st, NULL, 1);
+    if (ok) {
+        w->image = grow(w->image, &w->cap_image, out.output_len, 1);
+        output_copy(&out, w->image);
+        w->image_len = out.output_len;
+        ok = watch_write(w, 0, w->image, w->image_len)
+            && ftruncate(w->out_fd, w->image_len) == 0;
+    }
+    output_free(&out);
+    if (ok) {
+        w->valid = true;
+        fprintf(stderr, "%s: assembled %zu lines\n", w->input, w->n_lines);
+    } else {
+        watch_reset(w);
+    }
+}
+
+// Returns the index of the first line that starts at off or later.
+static size_t
+watch_find_line(const Watch *w, size_t off)
+{
+    size_t lo = 0;
+    size_t hi = w->n_lines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (w->lines[mid].off < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Returns the index of the first fixup at offset or later.
+static size_t
+watch_find_fixup(const Watch *w, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = w->n_fixups;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (w->fixups[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Whether the fixup at offset is in a branch that was made longer.
+static bool
+watch_in_relaxed(const Watch *w, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = w->n_relaxed;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (w->relaxed[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < w->n_relaxed && w->relaxed[lo].start <= offset;
+}
+
+static bool
+at_line_start(Str code, size_t i)
+{
+    return i == 0 || i == code.len || code.data[i - 1] == '\n';
+}
+
+// Updates the tables and the image from old to the current code.
+// Returns false if the whole code must be assembled instead.
+static bool
+watch_update(Watch *w, Str old)
+{
+    Str new = w->code;
+
+    // The changed text is new[start, new_end) instead of old[start,
+    // old_end), both whole lines.
+    size_t min_len = old.len < new.len ? old.len : new.len;
+    size_t start = 0;
+    while (start + 4096 <= min_len
+            && !memcmp(old.data + start, new.data + start, 4096))
+    {
+        start += 4096;
+    }
+    while (start < min_len && old.data[start] == new.data[start]) {
+        start++;
+    }
+    if (start == old.len && start == new.len) {
+        return true;
+    }
+    while (start > 0 && old.data[start - 1] != '\n') {
+        start--;
+    }
+    size_t same_end = 0;
+    size_t max_end = min_len - start;
+    while (same_end + 4096 <= max_end
+            && !memcmp(old.data + old.len - same_end - 4096,
+                new.data + new.len - same_end - 4096, 4096))
+    {
+        same_end += 4096;
+    }
+    while (same_end < max_end && old.data[old.len - same_end - 1]
+            == new.data[new.len - same_end - 1])
+    {
+        same_end++;
+    }
+    size_t old_end = old.len - same_end;
+    size_t new_end = new.len - same_end;
+    if (!at_line_start(old, old_end) || !at_line_start(new, new_end)) {
+        const char *nl = memchr(old.data + old_end, '\n', same_end);
+        size_t k = nl ? (size_t)(nl - old.data) + 1 - old_end : same_end;
+        old_end += k;
+        new_end += k;
+    }
+    if (memmem(old.data + start, old_end - start, "equ", 3)
+            || memmem(new.data + start, new_end - start, "equ", 3))
+    {
+        return false;
+    }
+
+    size_t first = watch_find_line(w, start);
+    size_t old_last = watch_find_line(w, old_end);
+    uint64_t pc_start = first < w->n_lines ? w->lines[first].pc
+        : w->image_len;
+    uint64_t pc_old_end = old_last < w->n_lines ? w->lines[old_last].pc
+        : w->image_len;
+
+    // Take the labels of the old lines out, and number the later lines
+    // as they will be.
+    size_t n_new_lines = 0;
+    for (const char *p = new.data + start;
+            (p = memchr(p, '\n', new.data + new_end - p)); p++)
+    {
+        n_new_lines++;
+    }
+    if (new_end > start && new.data[new_end - 1] != '\n') {
+        n_new_lines++;
+    }
+    size_t new_last = first + n_new_lines;
+    size_t n_syms = w->symtab.n_syms;
+    w->sym_flags = grow(w->sym_flags, &w->cap_sym_flags, n_syms + 1, 1);
+    for (size_t i = 0; i < n_syms; i++) {
+        Symbol *sym = &w->symtab.syms[i];
+        w->sym_flags[i] = 0;
+        if (sym->kind != SYM_LABEL || sym->line <= first) {
+            continue;
+        }
+        if (sym->line <= old_last) {
+            sym->kind = SYM_UNDEFINED;
+            w->sym_flags[i] = WATCH_SYM_CHANGED;
+        } else {
+            sym->line = sym->line - old_last + new_last;
+            w->sym_flags[i] = WATCH_SYM_MOVED;
+        }
+    }
+
+    Str part = {new.data, new_end};
+    State st = {
+        .code = part,
+        .i = start,
+        .scanner = scanner(part),
+        .line = first,
+        .pc = pc_start,
+        .symtab = w->symtab,
+    };
+    Output out = {0};
+    WatchLine *lines = NULL;
+    size_t n_lines = 0;
+    size_t cap_lines = 0;
+    watch_assemble(&st, &out, w->target, &lines, &n_lines, &cap_lines);
+    w->symtab = st.symtab;
+    free(st.toks);
+    bool ok = st.n_errors == 0;
+    for (size_t i = 0; i < st.n_errors; i++) {
+        free(st.diags[i].msg);
+    }
+    free(st.diags);
+    if (!ok) {
+        free(st.fixups);
+        free(st.aligns);
+        free(lines);
+        output_free(&out);
+        return false;
+    }
+
+    // The new labels.
+    w->sym_flags = grow(w->sym_flags, &w->cap_sym_flags,
+            w->symtab.n_syms + 1, 1);
+    for (size_t i = 0; i < w->symtab.n_syms; i++) {
+        const Symbol *sym = &w->symtab.syms[i];
+        if (i >= n_syms) {
+            w->sym_flags[i] = WATCH_SYM_CHANGED;
+        } else if (sym->kind == SYM_LABEL && sym->line > first
+                && sym->line <= new_last)
+        {
+            w->sym_flags[i] |= WATCH_SYM_CHANGED;
+        }
+    }
+    uint64_t len = out.output_len;
+    int64_t delta = (int64_t)len - (int64_t)(pc_old_end - pc_start);
+    int64_t off_delta = (int64_t)new_end - (int64_t)old_end;
+    // An alignment after the new lines needs new padding if they moved it.
+    if (delta && w->align_end > pc_old_end) {
+        free(st.fixups);
+        free(st.aligns);
+        free(lines);
+        output_free(&out);
+        return false;
+    }
+    if (st.n_aligns && st.aligns[st.n_aligns - 1].offset >= w->align_end) {
+        w->align_end = st.aligns[st.n_aligns - 1].offset + 1;
+    }
+    free(st.aligns);
+    if (delta) {
+        for (size_t i = 0; i < n_syms; i++) {
+            if (w->sym_flags[i] & WATCH_SYM_MOVED) {
+                w->symtab.syms[i].value += delta;
+            }
+        }
+    }
+    // The longer branches of the old lines are gone, as the new lines have
+    // theirs in the first form, and the ones after them move.
+    size_t n_relaxed = 0;
+    for (size_t i = 0; i < w->n_relaxed; i++) {
+        WatchRelaxed r = w->relaxed[i];
+        if (r.start >= pc_old_end) {
+            r.start += delta;
+            r.end += delta;
+        } else if (r.end > pc_start) {
+            continue;
+        }
+        w->relaxed[n_relaxed++] = r;
+    }
+    w->n_relaxed = n_relaxed;
+
+    // Put the new lines, fixups and output in place of the old ones, and
+    // move what comes after.
+    size_t n_after = w->n_lines - old_last;
+    w->lines = grow(w->lines, &w->cap_lines, first + n_lines + n_after,
+            sizeof *w->lines);
+    memmove(w->lines + first + n_lines, w->lines + old_last,
+            n_after * sizeof *w->lines);
+    memcpy(w->lines + first, lines, n_lines * sizeof *lines);
+    w->n_lines = first + n_lines + n_after;
+    for (size_t i = first + n_lines; i < w->n_lines; i++) {
+        w->lines[i].off += off_delta;
+        w->lines[i].pc += delta;
+    }
+    free(lines);
+
+    size_t fixup_start = watch_find_fixup(w, pc_start);
+    size_t fixup_old_end = watch_find_fixup(w, pc_old_end);
+    n_after = w->n_fixups - fixup_old_end;
+    w->fixups = grow(w->fixups, &w->cap_fixups,
+            fixup_start + st.n_fixups + n_after, sizeof *w->fixups);
+    memmove(w->fixups + fixup_start + st.n_fixups,
+            w->fixups + fixup_old_end, n_after * sizeof *w->fixups);
+    memcpy(w->fixups + fixup_start, st.fixups,
+            st.n_fixups * sizeof *st.fixups);
+    w->n_fixups = fixup_start + st.n_fixups + n_after;
+    // The offsets of the new fixups are in the output of the new lines.
+    for (size_t i = fixup_start; i < fixup_start + st.n_fixups; i++) {
+        w->fixups[i].offset += pc_start;
+    }
+    for (size_t i = fixup_start + st.n_fixups; i < w->n_fixups; i++) {
+        w->fixups[i].offset += delta;
+    }
+    free(st.fixups);
+
+    size_t image_after = w->image_len - pc_old_end;
+    w->image = grow(w->image, &w->cap_image, pc_start + len + image_after, 1);
+    memmove(w->image + pc_start + len, w->image + pc_old_end, image_after);
+    output_copy(&out, w->image + pc_start);
+    output_free(&out);
+    w->image_len = pc_start + len + image_after;
+
+    // Resolve the fixups that can have changed.
+    uint64_t pc_new_end = pc_start + len;
+    w->n_patched = 0;
+    for (size_t i = 0; i < w->n_fixups; i++) {
+        const Fixup *f = &w->fixups[i];
+        const Symbol *sym = &w->symtab.syms[f->sym];
+        uint8_t flags = w->sym_flags[f->sym];
+        bool in_new = f->offset >= pc_start && f->offset < pc_new_end;
+        bool moved = f->offset >= pc_new_end;
+        int64_t value;
+        if (f->kind == FIXUP_PCREL_LO_I || f->kind == FIXUP_PCREL_LO_S) {
+            // What the %pcrel_hi at its label adds, which changes with
+            // the label and the symbol of the %pcrel_hi.
+            if (sym->kind != SYM_LABEL) {
+                return false;
+            }
+            const Fixup *hi = find_pcrel_hi(w->fixups, w->n_fixups,
+                    sym->value);
+            if (!hi || (hi->offset >= pc_start && hi->offset < pc_new_end)) {
+                return false;
+            }
+            uint8_t hi_flags = w->sym_flags[hi->sym];
+            if (!in_new && !((flags | hi_flags) & WATCH_SYM_CHANGED)
+                    && !(delta && (flags ^ hi_flags) & WATCH_SYM_MOVED))
+            {
+                continue;
+            }
+            const Symbol *hi_sym = &w->symtab.syms[hi->sym];
+            if (hi_sym->kind == SYM_UNDEFINED) {
+                return false;
+            }
+            value = hi_sym->value - sym->value;
+        } else {
+            bool relative = fixup_is_relative(f->kind);
+            bool sym_moved = flags & WATCH_SYM_MOVED;
+            if (!in_new && !(flags & WATCH_SYM_CHANGED)
+                    && !(delta && (relative ? moved != sym_moved : sym_moved)))
+            {
+                continue;
+            }
+            if (sym->kind == SYM_UNDEFINED) {
+                return false;
+            }
+            value = fixup_value(f, sym->value);
+            if (!fixup_in_range(f->kind, value)) {
+                // Only a whole assembly can make the branch longer.
+                return false;
+            }
+        }
+        uint8_t *p = w->image + f->offset;
+        int size = fixup_size(f->kind);
+        uint64_t word = 0;
+        for (int b = 0; b < size; b++) {
+            word |= (uint64_t)p[b] << 8 * b;
+        }
+        uint64_t patched = (word & ~fixup_bits64(f->kind, -1))
+            | fixup_bits64(f->kind, value);
+        if (patched == word && !in_new) {
+            continue;
+        }
+        if (watch_in_relaxed(w, f->offset)) {
+            // Its label may be close enough for the first form now.
+            return false;
+        }
+        if (w->target & TARGET_C
+                && (f->kind == FIXUP_B || f->kind == FIXUP_J))
+        {
+            // The branch may fit a shorter form now, and only a whole
+            // assembly picks the forms.
+            return false;
+        }
+        for (int b = 0; b < size; b++) {
+            p[b] = patched >> 8 * b;
+        }
+        if (!in_new && !(delta && moved)) {
+            w->patched = grow(w->patched, &w->cap_patched,
+                    w->n_patched + 1, sizeof *w->patched);
+            w->patched[w->n_patched++] = f->offset;
+        }
+    }
+
+    // Write what changed: the new lines, and everything after them if
+    // they moved, and the patched fixups elsewhere.
+    uint64_t write_end = delta ? w->image_len : pc_new_end;
+    if (!watch_write(w, pc_start, w->image + pc_start, write_end - pc_start)
+            || (delta && ftruncate(w->out_fd, w->image_len) != 0))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < w->n_patched; i++) {
+        uint64_t off = w->patched[i];
+        // As much as a .dword, but the last fixup can be shorter.
+        uint64_t n = w->image_len - off < 8 ? w->image_len - off : 8;
+        if (!watch_write(w, off, w->image + off, n)) {
+            return false;
+        }
+    }
+    fprintf(stderr, "%s: reassembled %zu lines at line %zu, "
+            "patched %zu fixups\n",
+            w->input, n_lines, first + 1, w->n_patched);
+    return true;
+}
+
+// Reads the input.  Returns false if it cannot be read, which happens
+// for a moment while some editors save.
+static bool
+watch_read(Watch *w)
+{
+    int fd = open(w->input, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat sb;
+    char *text = NULL;
+    bool ok = fstat(fd, &sb) == 0 && (text = malloc(sb.st_size + 1));
+    size_t len = 0;
+    while (ok && len < (size_t)sb.st_size) {
+        ssize_t n = read(fd, text + len, sb.st_size - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Still being written, or cut short: wait for the next event.
+            ok = false;
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    if (!ok) {
+        free(text);
+        return false;
+    }
+    w->texts = grow(w->texts, &w->cap_texts, w->n_texts + 1,
+            sizeof *w->texts);
+    w->texts[w->n_texts++] = text;
+    w->texts_size += len;
+    w->code = (Str){text, len};
+    return true;
+}
+
+// Assembles input into output, and then again whenever input changes.
+// Only returns if it cannot watch.
+static bool
+watch(const char *input, const char *output, Target target)
+{
+    Watch w = {.input = input, .target = target};
+    w.out_fd = open(output, O_WRONLY | O_CREAT, 0644);
+    if (w.out_fd == -1) {
+        print_error("Could not open %s: %s\n", output, strerror(errno));
+        return false;
+    }
+
+    // Watch the directory, as editors often save by renaming a new file
+    // over the old one.
+    char *dir_copy = strdup(input);
+    char *base_copy = strdup(input);
+    if (!dir_copy || !base_copy) {
+        out_of_memory();
+    }
+    const char *dir = dirname(dir_copy);
+    const char *base = basename(base_copy);
+    int in = inotify_init1(IN_CLOEXEC);
+    if (in == -1 || inotify_add_watch(in, dir,
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1)
+    {
+        print_error("Could not watch %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+
+    if (!watch_read(&w)) {
+        print_error("Could not read %s\n", input);
+        return false;
+    }
+    watch_full(&w);
+    for (;;) {
+        char buf[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n = read(in, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            print_error("Could not watch %s: %s\n", dir, strerror(errno));
+            return false;
+        }
+        bool changed = false;
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const void *)p;
+            if (ev->len && !strcmp(ev->name, base)) {
+                changed = true;
+            }
+            p += sizeof *ev + ev->len;
+        }
+        if (!changed) {
+            continue;
+        }
+        Str old = w.code;
+        if (!watch_read(&w)) {
+            continue;
+        }
+        // Every update keeps the old code, so start over once they take
+        // much more than the code itself.
+        bool too_big = w.texts_size > 4 * w.code.len + (1 << 20);
+        if (!w.valid || too_big || !watch_update(&w, old)) {
+            watch_full(&w);
+        }
+    }
+}